@@ -0,0 +1,324 @@
+// Headless benchmarks of the ECS core against conventional layouts.
+// Usage: ECS_bench [maxEntities]
+// Prints one CSV row per measurement: operation,layout,entities,reps,best_ms,ns_per_entity
+
+#include "ecs.hpp"
+#include "integrator.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+using namespace ecs;
+
+// Same shapes as the components of the game, without the SFML types.
+struct vec2 {
+	float x, y;
+};
+struct transform {
+	vec2 pos;
+};
+struct physics {
+	float mass;
+	float radius;
+	float restitution = 0.5;
+	vec2 vel, velim, oldVel;
+	vec2 oldPos;
+	vec2 acc, oldAcc;
+};
+struct render {
+	float radius;
+	std::uint32_t colour;
+};
+struct rare {}; // tag carried by every 100th entity
+
+using BenchManager = EntityManager<transform, physics, render, rare>;
+
+// Conventional array of structs.
+struct ball {
+	transform tr;
+	physics ph;
+	render re;
+	bool isRare;
+};
+
+// Conventional struct of arrays.
+struct Balls {
+	std::vector<transform> tr;
+	std::vector<physics> ph;
+	std::vector<render> re;
+	std::vector<char> isRare;
+
+	void resize(size_t n) {
+		tr.resize(n);
+		ph.resize(n);
+		re.resize(n);
+		isRare.resize(n);
+	}
+	void swapAndPop(size_t i) {
+		tr[i] = tr.back(); tr.pop_back();
+		ph[i] = ph.back(); ph.pop_back();
+		re[i] = re.back(); re.pop_back();
+		isRare[i] = isRare.back(); isRare.pop_back();
+	}
+};
+
+constexpr float dt = 1e-3f;
+volatile float sink; // keeps results alive
+
+void init(size_t i, transform& tr, physics& ph, render& re) {
+	tr.pos = { (float)i, 0 };
+	ph.vel = { 1, 2 };
+	ph.radius = re.radius = 0.01f;
+}
+
+// Kernels shared by all layouts.
+inline void kernel1(transform& tr) {
+	tr.pos.y += dt;
+}
+inline void kernel2(transform& tr, physics& ph) {
+	tr.pos.x += ph.vel.x * dt;
+	tr.pos.y += ph.vel.y * dt;
+}
+inline void kernel3(transform& tr, physics& ph, render& re) {
+	kernel2(tr, ph);
+	re.radius = ph.radius;
+}
+
+
+// Runs 'setup' (untimed) and 'body' (timed) 'reps' times. Returns the fastest run in milliseconds.
+double measure(int reps, auto&& setup, auto&& body) {
+	double best = 1e300;
+	for (int r = 0; r < reps; ++r) {
+		setup();
+		auto t0 = std::chrono::steady_clock::now();
+		body();
+		auto t1 = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	return best;
+}
+
+void report(const char* operation, const char* layout, size_t n, int reps, double ms) {
+	std::printf("%s,%s,%zu,%d,%.4f,%.3f\n", operation, layout, n, reps, ms, ms * 1e6 / (double)n);
+	std::fflush(stdout);
+}
+
+void run(size_t n) {
+	const int reps = (int)std::clamp<size_t>(10'000'000 / n, 3, 50);
+	auto none = [] {};
+
+	// create
+	{
+		std::unique_ptr<BenchManager> em;
+		report("create", "ecs", n, reps, measure(reps, [&] { em = std::make_unique<BenchManager>(); }, [&] {
+			em->setPrefabbing(false);
+			em->createEntities<transform, physics, render>((int)n, [](size_t i, EntityHandle, transform& tr, physics& ph, render& re) {
+				init(i, tr, ph, re);
+				});
+			}));
+		std::vector<ball> aos;
+		report("create", "aos", n, reps, measure(reps, [&] { aos = {}; }, [&] {
+			aos.resize(n);
+			for (size_t i = 0; i < n; ++i)
+				init(i, aos[i].tr, aos[i].ph, aos[i].re);
+			}));
+		Balls soa;
+		report("create", "soa", n, reps, measure(reps, [&] { soa = {}; }, [&] {
+			soa.resize(n);
+			for (size_t i = 0; i < n; ++i)
+				init(i, soa.tr[i], soa.ph[i], soa.re[i]);
+			}));
+	}
+
+	// Worlds for the iteration benchmarks. Every 100th entity is rare.
+	BenchManager em;
+	em.setPrefabbing(false);
+	std::vector<EntityHandle> handles;
+	handles.reserve(n);
+	em.createEntities<transform, physics, render>((int)n, [&](size_t i, EntityHandle eh, transform& tr, physics& ph, render& re) {
+		init(i, tr, ph, re);
+		handles.push_back(eh);
+		});
+	for (size_t i = 0; i < n; i += 100)
+		em.attachComponents<rare>(handles[i], [](rare&) {});
+
+	std::vector<ball> aos(n);
+	Balls soa;
+	soa.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		init(i, aos[i].tr, aos[i].ph, aos[i].re);
+		init(i, soa.tr[i], soa.ph[i], soa.re[i]);
+		aos[i].isRare = i % 100 == 0;
+		soa.isRare[i] = aos[i].isRare;
+	}
+
+	// iterate
+	report("iterate1", "ecs", n, reps, measure(reps, none, [&] { em.forAllComponents<transform>(kernel1); }));
+	report("iterate1", "aos", n, reps, measure(reps, none, [&] { for (auto& b : aos) kernel1(b.tr); }));
+	report("iterate1", "soa", n, reps, measure(reps, none, [&] { for (auto& tr : soa.tr) kernel1(tr); }));
+
+	report("iterate2", "ecs", n, reps, measure(reps, none, [&] { em.forAllComponents<transform, physics>(kernel2); }));
+	report("iterate2", "ecs_chunk", n, reps, measure(reps, none, [&] {
+		em.forEachChunk<transform, physics>([](size_t k, std::span<transform> tr, std::span<physics> ph) {
+			for (size_t i = 0; i < k; ++i)
+				kernel2(tr[i], ph[i]);
+			});
+		}));
+	report("iterate2", "ecs_parallel", n, reps, measure(reps, none, [&] { em.parallelForAllComponents<transform, physics>(kernel2); }));
+	report("iterate2", "aos", n, reps, measure(reps, none, [&] { for (auto& b : aos) kernel2(b.tr, b.ph); }));
+	report("iterate2", "soa", n, reps, measure(reps, none, [&] { for (size_t i = 0; i < n; ++i) kernel2(soa.tr[i], soa.ph[i]); }));
+
+	report("iterate3", "ecs", n, reps, measure(reps, none, [&] { em.forAllComponents<transform, physics, render>(kernel3); }));
+	report("iterate3", "aos", n, reps, measure(reps, none, [&] { for (auto& b : aos) kernel3(b.tr, b.ph, b.re); }));
+	report("iterate3", "soa", n, reps, measure(reps, none, [&] { for (size_t i = 0; i < n; ++i) kernel3(soa.tr[i], soa.ph[i], soa.re[i]); }));
+
+	auto q = em.query<transform, rare>();
+	report("iterate_sparse", "ecs", n, reps, measure(reps, none, [&] { em.forAllComponents<transform, rare>([](transform& tr, rare&) { kernel1(tr); }); }));
+	report("iterate_sparse", "ecs_query", n, reps, measure(reps, none, [&] { q.forEach([](transform& tr, rare&) { kernel1(tr); }); }));
+	report("iterate_sparse", "aos", n, reps, measure(reps, none, [&] { for (auto& b : aos) if (b.isRare) kernel1(b.tr); }));
+	report("iterate_sparse", "soa", n, reps, measure(reps, none, [&] { for (size_t i = 0; i < n; ++i) if (soa.isRare[i]) kernel1(soa.tr[i]); }));
+
+	// kinetic energy
+	auto energy = [](physics const& ph) { return (ph.vel.x * ph.vel.x + ph.vel.y * ph.vel.y) / 2; };
+	report("reduce", "ecs", n, reps, measure(reps, none, [&] { float e = 0; em.forAllComponents<const physics>([&](physics const& ph) { e += energy(ph); }); sink = e; }));
+	report("reduce", "ecs_parallel", n, reps, measure(reps, none, [&] { sink = em.reduceComponents<const physics>(0.f, energy, std::plus<>()); }));
+	report("reduce", "aos", n, reps, measure(reps, none, [&] { float e = 0; for (auto& b : aos) e += energy(b.ph); sink = e; }));
+	report("reduce", "soa", n, reps, measure(reps, none, [&] { float e = 0; for (auto& ph : soa.ph) e += energy(ph); sink = e; }));
+
+	// Z-order sort of shuffled positions
+	std::mt19937 mt{ 1 };
+	std::uniform_real_distribution<float> coord(0, 1);
+	auto shuffle = [&] { em.forAllComponents<transform>([&](transform& tr) { tr.pos = { coord(mt), coord(mt) }; }); };
+	auto zorder = [](transform const& tr) { return morton((std::uint32_t)(tr.pos.x * 65535), (std::uint32_t)(tr.pos.y * 65535)); };
+	report("sort", "ecs", n, reps, measure(reps, shuffle, [&] { em.sortComponents<const transform>(zorder); }));
+
+	// Structural changes only exist for the entity manager, or are emulated with copies and swap-and-pop.
+	{
+		std::unique_ptr<BenchManager> em2;
+		std::vector<EntityHandle> hs;
+		auto setup = [&] {
+			em2 = std::make_unique<BenchManager>();
+			em2->setPrefabbing(false);
+			hs.clear();
+			em2->createEntities<transform, physics>((int)n, [&](size_t i, EntityHandle eh, transform& tr, physics&) {
+				tr.pos = { (float)i, 0 };
+				hs.push_back(eh);
+				});
+		};
+		report("attach", "ecs", n, reps, measure(reps, setup, [&] {
+			for (auto& eh : hs)
+				em2->attachComponents<render>(eh, [](render& re) { re.radius = 0.01f; });
+			}));
+		report("duplicate", "ecs", n, reps, measure(reps, setup, [&] {
+			for (auto& eh : hs)
+				em2->duplicateEntity(eh);
+			}));
+		report("instantiate", "ecs", n, reps, measure(reps, setup, [&] {
+			em2->instantiate(hs[0], (int)n, [](size_t, EntityHandle) {});
+			}));
+		report("destroy", "ecs", n, reps, measure(reps, [&] { setup(); std::shuffle(hs.begin(), hs.end(), std::mt19937{ 1 }); }, [&] {
+			for (auto& eh : hs)
+				em2->destroyEntity(eh);
+			}));
+	}
+	{
+		std::vector<ball> aos2;
+		report("duplicate", "aos", n, reps, measure(reps, [&] { aos2 = aos; aos2.shrink_to_fit(); }, [&] {
+			for (size_t i = 0; i < n; ++i)
+				aos2.push_back(aos2[i]);
+			}));
+		std::vector<size_t> order(n);
+		report("destroy", "aos", n, reps, measure(reps, [&] {
+			aos2 = aos;
+			std::mt19937 mt{ 1 };
+			for (size_t i = 0; i < n; ++i)
+				order[i] = std::uniform_int_distribution<size_t>(0, n - 1 - i)(mt);
+			}, [&] {
+			for (size_t i : order) {
+				aos2[i] = aos2.back();
+				aos2.pop_back();
+			}
+			}));
+		Balls soa2;
+		report("duplicate", "soa", n, reps, measure(reps, [&] { soa2 = soa; }, [&] {
+			for (size_t i = 0; i < n; ++i) {
+				soa2.tr.push_back(soa2.tr[i]);
+				soa2.ph.push_back(soa2.ph[i]);
+				soa2.re.push_back(soa2.re[i]);
+				soa2.isRare.push_back(soa2.isRare[i]);
+			}
+			}));
+		report("destroy", "soa", n, reps, measure(reps, [&] { soa2 = soa; }, [&] {
+			for (size_t i : order)
+				soa2.swapAndPop(i);
+			}));
+	}
+
+	// Motion step of the game on its components, through the thread pool as the game runs it
+	{
+		BenchManager balls;
+		balls.setPrefabbing(false);
+		std::uniform_real_distribution<float> angle(0, 6.2831853f), radius(0, 0.39f);
+		balls.createEntities<transform, physics>((int)n, [&](size_t, EntityHandle, transform& tr, physics& ph) {
+			const float a = angle(mt), r = radius(mt);
+			tr.pos = { r * std::cos(a), r * std::sin(a) };
+			ph.radius = 0.01f;
+			ph.restitution = 0.9f;
+			});
+		const integrator::World w{ 0, 0.8f, 0, 0, 0.4f, dt };
+		report("motion", "fused", n, reps, measure(reps, none, [&] {
+			balls.parallelForEachChunk<transform, physics>([&w](size_t k, std::span<transform> tr, std::span<physics> ph) {
+				integrator::stepFused(k, tr, ph, w);
+				});
+			}));
+		auto transposed = [&](integrator::Isa isa) {
+			return measure(reps, none, [&] {
+				balls.parallelForEachChunk<transform, physics>([&w, isa](size_t k, std::span<transform> tr, std::span<physics> ph) {
+					integrator::stepTransposed(k, tr, ph, w, isa);
+					});
+				});
+		};
+		report("motion", "transposed_scalar", n, reps, transposed(integrator::Isa::Scalar));
+		report("motion", "transposed_sse", n, reps, transposed(integrator::Isa::SSE));
+		if (integrator::bestIsa() == integrator::Isa::AVX2)
+			report("motion", "transposed_avx2", n, reps, transposed(integrator::Isa::AVX2));
+	}
+
+	// integrator kernel alone, on split x/y arrays that need no copies
+	{
+		std::vector<std::vector<float>> arrays(16, std::vector<float>(n));
+		for (size_t i = 0; i < n; ++i) {
+			arrays[0][i] = 0.4f * std::cos((float)i); // px
+			arrays[1][i] = 0.4f * std::sin((float)i); // py
+			arrays[14][i] = 0.01f;                    // radius
+			arrays[15][i] = 0.9f;                     // restitution
+		}
+		auto a = [&](int k) { return arrays[k].data(); };
+		const integrator::Bodies b{ n, a(0), a(1), a(2), a(3), a(4), a(5), a(6), a(7), a(8), a(9), a(10), a(11), a(12), a(13), a(14), a(15) };
+		const integrator::World w{ 0, 0.8f, 0, 0, 0.4f, dt };
+		report("integrate", "scalar", n, reps, measure(reps, none, [&] { integrator::step(b, w, integrator::Isa::Scalar); }));
+		report("integrate", "sse", n, reps, measure(reps, none, [&] { integrator::step(b, w, integrator::Isa::SSE); }));
+		if (integrator::bestIsa() == integrator::Isa::AVX2)
+			report("integrate", "avx2", n, reps, measure(reps, none, [&] { integrator::step(b, w, integrator::Isa::AVX2); }));
+	}
+
+	float s = 0;
+	em.forAllComponents<transform>([&s](transform& tr) { s += tr.pos.y; });
+	sink = s;
+}
+
+int main(int argc, char** argv) {
+	size_t maxEntities = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+	std::printf("operation,layout,entities,reps,best_ms,ns_per_entity\n");
+	for (size_t n = 1000; n <= maxEntities; n *= 10)
+		run(n);
+	return 0;
+}
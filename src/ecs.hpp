@@ -6,6 +6,23 @@
 #include <bit>
 #include <numeric>
 #include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <span>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <memory_resource>
+#include <atomic>
+#include <new>
+#include <cstddef>
+
+#include "threadpool.hpp"
 
 namespace ecs_utils {
 
@@ -49,7 +66,7 @@ namespace ecs_utils {
 
 		template<typename... A>
 		class SubList {
-			static constexpr size_t a[] = { index_of<A>()... };
+			static constexpr std::array<size_t, sizeof...(A)> a = { index_of<A>()... };
 		public:
 			static constexpr bool in_order = std::is_sorted(std::cbegin(a), std::cend(a));
 
@@ -60,12 +77,6 @@ namespace ecs_utils {
 			//				return arr;
 			//			}
 		};
-		template<>
-		class SubList<> {
-
-		public:
-			static constexpr bool in_order = true;
-		};
 
 
 		template<typename U>
@@ -102,14 +113,16 @@ namespace ecs_utils {
 	}
 
 
-	// Permutes 'a' in-place such that a[i] |-> a[p[i]].
+	// Permutes 'a' in-place such that a[i] |-> a[p[i]], i.e. afterwards a[i] holds what was at a[p[i]]. Resets 'p' to the identity.
+	// Elements are exchanged by an unqualified 'swap', so 'a' may hand out proxies.
 	template<typename A, typename P>
 	void inplace_permute(A&& a, P&& p) {
+		using std::swap;
 		for (size_t i = 0; i < a.size(); ++i) {
 			size_t curr = i;
 			size_t next = p[curr];
 			while (next != i) {
-				std::swap(a[curr], a[next]);
+				swap(a[curr], a[next]);
 				p[curr] = curr;
 				curr = next;
 				next = p[next];
@@ -120,63 +133,590 @@ namespace ecs_utils {
 
 
 
+	// Interleaves the bits of 'x' and 'y' into a position on the Z-order curve.
+	// Points close to each other in 2D mostly get close codes, so sorting by it groups them in memory.
+	constexpr std::uint64_t morton(std::uint32_t x, std::uint32_t y) {
+		auto spread = [](std::uint64_t v) {
+			v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+			v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+			v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+			v = (v | (v << 2)) & 0x3333333333333333ull;
+			v = (v | (v << 1)) & 0x5555555555555555ull;
+			return v;
+		};
+		return spread(x) | (spread(y) << 1);
+	}
+
+	// Concatenates TypeLists.
+	template<typename... L>
+	struct concat {
+		using type = TypeList<>;
+	};
+	template<typename... A>
+	struct concat<TypeList<A...>> {
+		using type = TypeList<A...>;
+	};
+	template<typename... A, typename... B, typename... L>
+	struct concat<TypeList<A...>, TypeList<B...>, L...> {
+		using type = typename concat<TypeList<A..., B...>, L...>::type;
+	};
+	template<typename... L>
+	using concat_t = typename concat<L...>::type;
+
+
 	template<typename U0, typename... U>
 	constexpr bool is_duplicate_free = !(std::same_as<U0, U> || ...) && is_duplicate_free<U...>;
 
 	template<typename U0>
 	constexpr bool is_duplicate_free<U0> = true;
+
+
+	// Fixed-size bit set that is usable in constant expressions, unlike std::bitset.
+	// Operations loop over all words without early exits, so they compile to a few (vector) instructions,
+	// and to plain integer operations for up to 64 bits.
+	template<size_t N>
+	class BitSet {
+		static constexpr size_t words = N == 0 ? 1 : (N + 63) / 64;
+		std::array<std::uint64_t, words> w{};
+
+	public:
+		constexpr BitSet& set(size_t i) {
+			w[i / 64] |= std::uint64_t{ 1 } << (i % 64);
+			return *this;
+		}
+		constexpr bool test(size_t i) const {
+			return (w[i / 64] >> (i % 64)) & 1;
+		}
+		constexpr bool any() const {
+			std::uint64_t acc = 0;
+			for (size_t i = 0; i < words; ++i)
+				acc |= w[i];
+			return acc != 0;
+		}
+		constexpr explicit operator bool() const {
+			return any();
+		}
+		// Whether every bit of this set is also in 'o'.
+		constexpr bool isSubsetOf(BitSet const& o) const {
+			std::uint64_t acc = 0;
+			for (size_t i = 0; i < words; ++i)
+				acc |= w[i] & ~o.w[i];
+			return acc == 0;
+		}
+		constexpr bool intersects(BitSet const& o) const {
+			std::uint64_t acc = 0;
+			for (size_t i = 0; i < words; ++i)
+				acc |= w[i] & o.w[i];
+			return acc != 0;
+		}
+
+		constexpr BitSet& operator|=(BitSet const& o) {
+			for (size_t i = 0; i < words; ++i)
+				w[i] |= o.w[i];
+			return *this;
+		}
+		constexpr BitSet& operator&=(BitSet const& o) {
+			for (size_t i = 0; i < words; ++i)
+				w[i] &= o.w[i];
+			return *this;
+		}
+		friend constexpr BitSet operator|(BitSet a, BitSet const& b) {
+			return a |= b;
+		}
+		friend constexpr BitSet operator&(BitSet a, BitSet const& b) {
+			return a &= b;
+		}
+		constexpr BitSet operator~() const {
+			BitSet r;
+			for (size_t i = 0; i < words; ++i)
+				r.w[i] = ~w[i];
+			if constexpr (N % 64 != 0) // keep the unused bits clear, so comparisons and hashes only see real ones
+				r.w[words - 1] &= (std::uint64_t{ 1 } << (N % 64)) - 1;
+			return r;
+		}
+		constexpr auto operator<=>(BitSet const&) const = default;
+
+		// The underlying 64-bit words, for hashing and serialization.
+		static constexpr size_t numWords() {
+			return words;
+		}
+		constexpr std::uint64_t word(size_t i) const {
+			return w[i];
+		}
+		constexpr void setWord(size_t i, std::uint64_t v) {
+			w[i] = v;
+		}
+	};
 }
 
+template<size_t N>
+struct std::hash<ecs_utils::BitSet<N>> {
+	size_t operator()(ecs_utils::BitSet<N> const& b) const {
+		std::uint64_t h = 0;
+		for (size_t i = 0; i < b.numWords(); ++i)
+			h = (h ^ b.word(i)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(h ^ (h >> 32));
+	}
+};
+
 namespace ecs
 {
 	using namespace ecs_utils;
 
+	// Sequential binary output of snapshots. Keeps track of the offset to align raw blocks.
+	struct SnapshotWriter {
+		std::ostream& out;
+		std::uint64_t pos = 0;
+
+		void bytes(const void* p, size_t n) {
+			out.write(static_cast<const char*>(p), n);
+			pos += n;
+		}
+		template<class T>
+		void value(T const& v) {
+			bytes(&v, sizeof(T));
+		}
+		// Pads to the next multiple of 64 bytes, so blocks can be used in place when the file is memory mapped.
+		void align() {
+			static constexpr char zeros[64]{};
+			bytes(zeros, (64 - pos % 64) % 64);
+		}
+	};
+
+	// Counterpart of 'SnapshotWriter'. All functions return false once the input failed.
+	struct SnapshotReader {
+		std::istream& in;
+		std::uint64_t pos = 0;
+
+		bool bytes(void* p, size_t n) {
+			in.read(static_cast<char*>(p), n);
+			pos += n;
+			return bool(in);
+		}
+		template<class T>
+		bool value(T& v) {
+			return bytes(&v, sizeof(T));
+		}
+		bool align() {
+			char skip[64];
+			return bytes(skip, (64 - pos % 64) % 64);
+		}
+	};
+
+	// Memory resource that counts the bytes it hands out, and fails allocations that would exceed 'limit'.
+	// Pass it to an 'EntityManager' to account for or bound the memory of a world. Thread-safe if 'upstream' is.
+	class TrackingResource : public std::pmr::memory_resource {
+		std::pmr::memory_resource* upstream;
+		size_t limit;
+		std::atomic<size_t> used{ 0 };
+		std::atomic<size_t> peak{ 0 };
+
+		void* do_allocate(size_t bytes, size_t alignment) override {
+			const size_t now = used.fetch_add(bytes) + bytes;
+			if (now > limit) {
+				used.fetch_sub(bytes);
+				throw std::bad_alloc();
+			}
+			size_t p = peak.load();
+			while (now > p && !peak.compare_exchange_weak(p, now)) {}
+			try {
+				return upstream->allocate(bytes, alignment);
+			}
+			catch (...) {
+				used.fetch_sub(bytes);
+				throw;
+			}
+		}
+		void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+			upstream->deallocate(p, bytes, alignment);
+			used.fetch_sub(bytes);
+		}
+		bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+			return this == &other;
+		}
+
+	public:
+		explicit TrackingResource(size_t limit = SIZE_MAX, std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+			: upstream{ upstream }, limit{ limit } {}
+
+		// Returns the number of bytes currently allocated.
+		size_t bytesUsed() const {
+			return used.load();
+		}
+		// Returns the highest number of bytes that were allocated at the same time.
+		size_t peakBytes() const {
+			return peak.load();
+		}
+	};
+
+	// Memory for the temporary buffers of a single call. Starts on the stack and continues on 'upstream' if needed.
+	// Everything is released at once when it goes out of scope.
+	class Scratch {
+		alignas(std::max_align_t) std::byte buffer[4096];
+		std::pmr::monotonic_buffer_resource arena;
+
+	public:
+		explicit Scratch(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+			: arena{ buffer, sizeof(buffer), upstream } {}
+		Scratch(Scratch const&) = delete;
+		Scratch& operator=(Scratch const&) = delete;
+
+		std::pmr::memory_resource* get() {
+			return &arena;
+		}
+	};
+
+	// Customization point to save components that are not trivially copyable in snapshots. Specialize it with
+	// 'static void write(SnapshotWriter&, T const&)' and 'static bool read(SnapshotReader&, T&)'.
+	// Trivially copyable components are saved as raw blocks and never use it.
+	template<class T>
+	struct Serializer {
+		static_assert(std::is_trivially_copyable_v<T>, "Components that are not trivially copyable need a specialization of 'ecs::Serializer'.");
+		static void write(SnapshotWriter& w, T const& t) {
+			w.value(t);
+		}
+		static bool read(SnapshotReader& r, T& t) {
+			return r.value(t);
+		}
+	};
+
 	// Class to store the data of components.
+	// Holds one contiguous array per component type (SoA). The owner decides which of them are in use by passing 'bits'.
 	template<typename... TComponents> requires is_duplicate_free<TComponents...>
 	class ComponentStorage {
-		std::tuple<std::vector<TComponents>...> data;
+		std::tuple<std::pmr::vector<TComponents>...> data;
+
+		template<class TComponent>
+		std::pmr::vector<TComponent>& get() {
+			return std::get<TComponentList::template index_of<TComponent>()>(data);
+		}
+		template<class TComponent>
+		std::pmr::vector<TComponent> const& get() const {
+			return std::get<TComponentList::template index_of<TComponent>()>(data);
+		}
 
 	public:
-		using TComponentBits = unsigned long long;// std::bitset<sizeof...(TComponents)>; bitset is not constexpr enough
+		// Allocates the arrays from 'mr'.
+		explicit ComponentStorage(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+			: data{ std::pmr::vector<TComponents>(mr)... } {}
+
+		using TComponentBits = BitSet<sizeof...(TComponents)>;
 		using TComponentList = TypeList<TComponents...>;
 
 		// Returns the bit mask for the given combination of component types.
 		template<class... T> requires TComponentList::template is_subset<T...>
 		static constexpr TComponentBits getMask() {
-			static_assert(sizeof...(TComponents) <= sizeof(unsigned long long) * CHAR_BIT);
-			unsigned long long b{ 0 }; // workaround until std::bitset is more constexpr
-			TypeList<T...>::for_each([&b](auto t)constexpr {
-				b |= 1 << (TComponentList::template index_of<typename decltype(t)::type>());
+			TComponentBits b;
+			(b.set(TComponentList::template index_of<T>()), ...);
+			return b;
+		}
+
+		// Calls 'f' with a TypeIndex for each component type in 'bits' that occupies memory.
+		// Empty types (tags) only exist as bits in the signature and are skipped.
+		static constexpr void for_each(TComponentBits const& bits, auto&& f) {
+			TComponentList::for_each([&](auto t) {
+				using T = typename decltype(t)::type;
+				if constexpr (!std::is_empty_v<T>)
+					if (bits.test(t.i))
+						f(t);
 				});
-			return TComponentBits{ b };
+		}
+
+		// Returns the summed size of one component of each type in 'bits'.
+		static constexpr size_t getRowSize(TComponentBits const& bits) {
+			size_t s = 0;
+			for_each(bits, [&s](auto t) { s += sizeof(typename decltype(t)::type); });
+			return s;
+		}
+
+		// Reserves space for 'n' components of each type in 'bits'.
+		void reserve(TComponentBits const& bits, size_t n) {
+			for_each(bits, [this, n](auto t) { get<typename decltype(t)::type>().reserve(n); });
 		}
 
 		// Creates a new component of specified type.
 		template<class TComponent, typename... Args> requires TComponentList::template is_any<TComponent>
 		size_t createComponent(Args&&...args) {
-			constexpr auto ind = TComponentList::template index_of<TComponent>();
-			auto& d = std::get<ind>(data);
-			auto oldSize = d.size();
-			d.resize(d.size() + 1);
-			std::construct_at<TComponent>(d.data() + oldSize, std::forward<Args>(args)...);
-			return oldSize;
+			if constexpr (std::is_empty_v<TComponent>)
+				return 0;
+			else {
+				auto& d = get<TComponent>();
+				d.emplace_back(std::forward<Args>(args)...);
+				return d.size() - 1;
+			}
 		}
 
-		// Returns the pointer to the i-th component of specified type.
+		// Appends 'n' default constructed components of each of the types 'T'.
+		template<class... T> requires TComponentList::template is_subset<T...>
+		void createComponents(size_t n) {
+			([this, n] {
+				if constexpr (!std::is_empty_v<T>) {
+					auto& d = get<T>();
+					d.resize(d.size() + n);
+				}
+				}(), ...);
+		}
+
+		// Creates a default constructed component of each type in 'bits'.
+		void createComponents(TComponentBits const& bits) {
+			for_each(bits, [this](auto t) { createComponent<typename decltype(t)::type>(); });
+		}
+
+		// Appends a copy of the i-th component of each type in 'bits' from 'other'. 'other' may be this storage.
+		void copyComponents(ComponentStorage& other, size_t i, TComponentBits const& bits) {
+			copyComponents(other, i, bits, 1);
+		}
+		// Appends 'n' copies of the i-th component of each type in 'bits' from 'other'.
+		void copyComponents(ComponentStorage& other, size_t i, TComponentBits const& bits, size_t n) {
+			for_each(bits, [this, &other, i, n](auto t) {
+				using T = typename decltype(t)::type;
+				auto& d = get<T>();
+				d.insert(d.end(), n, other.get<T>()[i]);
+				});
+		}
+
+		// Appends the i-th component of each type in 'bits' from 'other' by moving it.
+		void moveComponents(ComponentStorage& other, size_t i, TComponentBits const& bits) {
+			for_each(bits, [this, &other, i](auto t) {
+				using T = typename decltype(t)::type;
+				get<T>().push_back(std::move(other.get<T>()[i]));
+				});
+		}
+
+		// Move-assigns the j-th component of each type in 'bits' from 'other' to the i-th component.
+		void assignComponents(size_t i, ComponentStorage& other, size_t j, TComponentBits const& bits) {
+			for_each(bits, [this, &other, i, j](auto t) {
+				using T = typename decltype(t)::type;
+				get<T>()[i] = std::move(other.get<T>()[j]);
+				});
+		}
+
+		// Like 'moveComponents', but takes the component of the k-th type in the component list from row 'rows[k]'.
+		void moveComponents(ComponentStorage& other, std::span<const std::uint32_t> rows, TComponentBits const& bits) {
+			for_each(bits, [this, &other, rows](auto t) {
+				using T = typename decltype(t)::type;
+				get<T>().push_back(std::move(other.get<T>()[rows[t.i]]));
+				});
+		}
+
+		// Like 'assignComponents', but takes the component of the k-th type in the component list from row 'rows[k]'.
+		void assignComponents(size_t i, ComponentStorage& other, std::span<const std::uint32_t> rows, TComponentBits const& bits) {
+			for_each(bits, [this, &other, i, rows](auto t) {
+				using T = typename decltype(t)::type;
+				get<T>()[i] = std::move(other.get<T>()[rows[t.i]]);
+				});
+		}
+
+		// Swaps the i-th component of each type in 'bits' with the j-th component in 'other'. 'other' may be this storage.
+		void swapComponents(size_t i, ComponentStorage& other, size_t j, TComponentBits const& bits) {
+			for_each(bits, [this, &other, i, j](auto t) {
+				using T = typename decltype(t)::type;
+				using std::swap;
+				swap(get<T>()[i], other.get<T>()[j]);
+				});
+		}
+
+		// Removes the last component of each type in 'bits'.
+		void popComponents(TComponentBits const& bits) {
+			for_each(bits, [this](auto t) { get<typename decltype(t)::type>().pop_back(); });
+		}
+
+		// Writes the components of each type in 'bits' to a snapshot.
+		// Trivially copyable types are written as one aligned raw block, all others through 'Serializer'.
+		void save(SnapshotWriter& w, TComponentBits const& bits) const {
+			for_each(bits, [this, &w](auto t) {
+				using T = typename decltype(t)::type;
+				auto const& d = get<T>();
+				w.value(static_cast<std::uint64_t>(d.size()));
+				if constexpr (std::is_trivially_copyable_v<T>) {
+					w.align();
+					w.bytes(d.data(), d.size() * sizeof(T));
+				}
+				else
+					for (auto const& c : d)
+						Serializer<T>::write(w, c);
+				});
+		}
+
+		// Reads 'n' components of each type in 'bits', as written by 'save', into this empty storage.
+		// Fails if the snapshot holds another number, or more than are reserved, so the memory is never reallocated.
+		bool load(SnapshotReader& r, TComponentBits const& bits, size_t n) {
+			bool ok = true;
+			for_each(bits, [this, &r, &ok, n](auto t) {
+				using T = typename decltype(t)::type;
+				auto& d = get<T>();
+				std::uint64_t saved = 0;
+				if (!ok || !r.value(saved) || saved != n || n > d.capacity()) {
+					ok = false;
+					return;
+				}
+				d.resize(n);
+				if constexpr (std::is_trivially_copyable_v<T>)
+					ok = r.align() && r.bytes(d.data(), n * sizeof(T));
+				else
+					for (auto& c : d)
+						ok = ok && Serializer<T>::read(r, c);
+				});
+			return ok;
+		}
+
+		// Removes all components, keeping the memory.
+		void clear() {
+			std::apply([](auto&... d) { (d.clear(), ...); }, data);
+		}
+
+		// Returns the pointer to the i-th component of specified type. All tags of one type share the same instance.
 		template<class TComponent>
 		TComponent* getData(size_t i) {
-			return std::get<TComponentList::template index_of<TComponent>()>(data).data() + i;
+			if constexpr (std::is_empty_v<TComponent>) {
+				static TComponent tag;
+				return &tag;
+			}
+			else
+				return get<TComponent>().data() + i;
+		}
+	};
+
+	// Query terms. Queries only match entities that have all components of 'With' and none of 'Without'.
+	// 'AnyOf' requires at least one of its components, without passing them. Every 'AnyOf' term is checked on its own.
+	// 'Optional' components are passed as pointers, which are null for entities without them.
+	// A plain component type T is the same as With<T>. Components asked for as 'const T' are read-only.
+	// 'Changed' and 'Added' only pass entities whose components were changed or added since the query last ran.
+	// They work per chunk and are only available on a 'Query', see 'EntityManager::query'.
+	template<class... T> struct With {};
+	template<class... T> struct Without {};
+	template<class... T> struct AnyOf {
+		static_assert(sizeof...(T) > 0, "'AnyOf' needs at least one component.");
+	};
+	template<class... T> struct Optional {};
+	template<class... T> struct Changed {};
+	template<class... T> struct Added {};
+
+	// A component that is passed to a query callback. 'T' is const for read-only access.
+	template<class T, bool optional>
+	struct Fetch {
+		using type = T;
+		using component = std::remove_const_t<T>;
+		using arg = std::conditional_t<optional, T*, T&>;
+		static constexpr bool isOptional = optional;
+
+		// Returns the 'n' components starting at 'p'. Empty for tags and missing optional components.
+		static std::span<T> span(T* p, size_t n) {
+			if constexpr (std::is_empty_v<T>)
+				return {};
+			else
+				return { p, p ? n : 0 };
+		}
+
+		static arg get(T* p, size_t i) {
+			if constexpr (std::is_empty_v<T>) // tags share one instance
+				i = 0;
+			if constexpr (optional)
+				return p ? p + i : nullptr;
+			else
+				return p[i];
 		}
 	};
 
-	// Handle on a single entity.
+	// Splits a query term into the components it requires, excludes, passes to the callback and checks for changes.
+	struct NoChangeTerm {
+		using TChanged = TypeList<>;
+		using TAdded = TypeList<>;
+	};
+	template<class T>
+	struct Term : NoChangeTerm {
+		using TWith = TypeList<std::remove_const_t<T>>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<Fetch<T, false>>;
+	};
+	template<class... T>
+	struct Term<With<T...>> : NoChangeTerm {
+		using TWith = TypeList<std::remove_const_t<T>...>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<Fetch<T, false>...>;
+	};
+	template<class... T>
+	struct Term<Without<T...>> : NoChangeTerm {
+		using TWith = TypeList<>;
+		using TWithout = TypeList<std::remove_const_t<T>...>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<>;
+	};
+	template<class... T>
+	struct Term<AnyOf<T...>> : NoChangeTerm {
+		using TWith = TypeList<>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<TypeList<std::remove_const_t<T>...>>; // one group per term
+		using TFetches = TypeList<>;
+	};
+	template<class... T>
+	struct Term<Optional<T...>> : NoChangeTerm {
+		using TWith = TypeList<>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<Fetch<T, true>...>;
+	};
+	template<class... T>
+	struct Term<Changed<T...>> {
+		using TWith = TypeList<std::remove_const_t<T>...>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<>;
+		using TChanged = TypeList<std::remove_const_t<T>...>;
+		using TAdded = TypeList<>;
+	};
+	template<class... T>
+	struct Term<Added<T...>> {
+		using TWith = TypeList<std::remove_const_t<T>...>;
+		using TWithout = TypeList<>;
+		using TAnyOf = TypeList<>;
+		using TFetches = TypeList<>;
+		using TChanged = TypeList<>;
+		using TAdded = TypeList<std::remove_const_t<T>...>;
+	};
+
+	// All terms of a query combined.
+	template<class... TTerms>
+	struct Filter {
+		using TWith = concat_t<typename Term<TTerms>::TWith...>;
+		using TWithout = concat_t<typename Term<TTerms>::TWithout...>;
+		using TAnyOf = concat_t<typename Term<TTerms>::TAnyOf...>; // list of the component lists of the 'AnyOf' terms
+		using TFetches = concat_t<typename Term<TTerms>::TFetches...>;
+		using TChanged = concat_t<typename Term<TTerms>::TChanged...>;
+		using TAdded = concat_t<typename Term<TTerms>::TAdded...>;
+
+		static constexpr bool hasChangeFilters = TChanged::size() + TAdded::size() > 0;
+
+		// Whether 'F' can be called with 'TArgs' followed by the fetched components.
+		template<class F, class... TArgs>
+		static constexpr bool is_invocable = []<class... TF>(TypeList<TF...>) {
+			return std::is_invocable_v<F, TArgs..., typename TF::arg...>;
+		}(TFetches{});
+		// Type returned by 'F' when called with the fetched components.
+		template<class F>
+		using invoke_result_t = typename decltype([]<class... TF>(TypeList<TF...>) {
+			return std::type_identity<std::invoke_result_t<F, typename TF::arg...>>{};
+		}(TFetches{}))::type;
+		// Whether 'F' can be called with a row count followed by one span per fetched component.
+		template<class F>
+		static constexpr bool is_chunk_invocable = []<class... TF>(TypeList<TF...>) {
+			return std::is_invocable_v<F, size_t, std::span<typename TF::type>...>;
+		}(TFetches{});
+	};
+
+	// Handle on a single entity. Becomes stale when the entity is destroyed.
 	struct EntityHandle {
-		size_t idx;
+		std::uint32_t idx;
+		std::uint32_t generation;
 	};
 
-	const EntityHandle emptyHandle = { -1 }; // TODO this will intentionally crash eventually
+	const EntityHandle emptyHandle = { UINT32_MAX, 0 }; // never alive
 
 	// Class to store and manage entities.
+	// Entities with the same component signature (archetype) are stored together in fixed-size chunks,
+	// so iterating over components is a linear sweep over the chunks of all matching archetypes.
 	template<typename... TComponents> requires is_duplicate_free<TComponents...>
 	class EntityManager {
 
@@ -184,135 +724,1073 @@ namespace ecs
 		using TComponentList = typename TComponentStorage::TComponentList;
 		using TComponentBits = typename TComponentStorage::TComponentBits;
 
-		struct Entity {
+		// Targeted amount of component data per chunk.
+		static constexpr size_t chunkBytes = 16 * 1024;
+
+		using Ticks = std::array<std::uint32_t, sizeof...(TComponents)>; // one per component type
+
+		// A block of at most 'Archetype::chunkCapacity' entities. Never reallocates, so components have stable addresses.
+		struct Chunk {
+			TComponentBits bits; // signature of the archetype
+			TComponentStorage cs;
+			std::pmr::vector<size_t> entityIdx; // index into 'entities' of each row
+			Ticks changed{}; // last tick at which the components of each type may have been written
+			Ticks added{};   // last tick at which entities gained components of each type in this chunk
+
+			explicit Chunk(std::pmr::memory_resource* mr) : cs{ mr }, entityIdx{ mr } {}
+
+			size_t size() const { return entityIdx.size(); }
+		};
+
+		// All entities with the same component signature.
+		struct Archetype {
 			TComponentBits bits;
-			std::vector<std::size_t> compIndices;
-			bool isPrefab; // TODO more elegant would be if the prefab property is a component
+			bool isPrefab;
+			size_t chunkCapacity;
+			std::pmr::vector<Chunk> chunks; // all chunks are full, except the last one
 		};
 
-		std::vector<Entity> entities;
-		TComponentStorage cs;
+		// Location of an entity's components.
+		struct Location {
+			size_t archetype;
+			size_t chunk;
+			size_t row;
+		};
+		static constexpr size_t noArchetype = static_cast<size_t>(-1);
+
+		// Slot of an entity. Slots of destroyed entities are reused with an incremented generation.
+		struct Entity {
+			Location loc;
+			std::uint32_t generation;
+		};
+
+		std::pmr::memory_resource* upstream; // source of all memory of entities and components
+		// Holds the component arrays of the chunks. Freed arrays are reused by new chunks of any archetype.
+		std::pmr::unsynchronized_pool_resource chunkPool{ std::pmr::pool_options{ 0, chunkBytes }, upstream };
+
+		std::pmr::vector<Entity> entities{ upstream };
+		std::pmr::vector<std::uint32_t> freeSlots{ upstream };
+		std::pmr::vector<Archetype> archetypes{ upstream };
+		using Lookup = std::pmr::unordered_map<TComponentBits, size_t>;
+		Lookup archetypeLookup[2]{ Lookup(upstream), Lookup(upstream) }; // indexed by 'isPrefab'
+		std::uint32_t archetypeEpoch = 0; // advanced whenever 'archetypes' is replaced, so queries start over
+
+		ThreadPool* pool = nullptr;
+		std::unique_ptr<ThreadPool> ownPool; // created on first use if no pool was set
+
+		// Stamped into the chunks on every write. Advanced whenever a query with change filters has run.
+		// Atomic, since the scheduler runs such queries alongside systems that write other components.
+		std::atomic<std::uint32_t> changeTick{ 1 };
 
-		// Returns the number of set bits in 'bits' to the right of the mask bit 'ask', given that bits&ask>0.
-		static constexpr size_t getNumRight(TComponentBits const& bits, TComponentBits const& ask) {
-			return std::popcount(bits << (std::countl_zero(ask))) - 1;
+		// Sets the ticks of all component types in 'bits' to the current tick.
+		void stamp(Ticks& ticks, TComponentBits const& bits) const {
+			const std::uint32_t tick = changeTick.load(std::memory_order_relaxed);
+			TComponentList::for_each([&](auto t) {
+				if (bits.test(t.i))
+					ticks[t.i] = tick;
+				});
+		}
+		// Marks the components in 'bits' of chunk 'c' as written, and those in 'addedBits' as newly added.
+		void touch(Chunk& c, TComponentBits const& bits, TComponentBits const& addedBits = {}) const {
+			stamp(c.changed, bits);
+			stamp(c.added, addedBits);
+		}
+
+		static constexpr char snapshotMagic[8] = { 'E', 'C', 'S', 'S', 'N', 'A', 'P', '\0' };
+		static constexpr std::uint32_t snapshotVersion = 1;
+
+		// Entity slot as stored in snapshots, without padding.
+		struct SavedEntity {
+			std::uint64_t archetype, chunk, row;
+			std::uint32_t generation, unused;
+		};
+
+		// Size, alignment and copyability of every component type, so snapshots of other builds are rejected.
+		static constexpr std::array<std::uint32_t, 2 + 3 * sizeof...(TComponents)> layout() {
+			std::array<std::uint32_t, 2 + 3 * sizeof...(TComponents)> l{ static_cast<std::uint32_t>(sizeof(size_t)), static_cast<std::uint32_t>(sizeof...(TComponents)) };
+			size_t k = 2;
+			TComponentList::for_each([&l, &k](auto t) {
+				using T = typename decltype(t)::type;
+				l[k++] = static_cast<std::uint32_t>(sizeof(T));
+				l[k++] = static_cast<std::uint32_t>(alignof(T));
+				l[k++] = std::is_trivially_copyable_v<T>;
+				});
+			return l;
+		}
+		static void writeLayout(SnapshotWriter& w) {
+			for (auto v : layout())
+				w.value(v);
+		}
+		static bool readLayout(SnapshotReader& r) {
+			for (auto v : layout()) {
+				std::uint32_t saved;
+				if (!r.value(saved) || saved != v)
+					return false;
+			}
+			return true;
+		}
+
+		// Writes the size of 'v' followed by its elements as one aligned block.
+		template<class TVector>
+		static void writeBlock(SnapshotWriter& w, TVector const& v) {
+			w.value(static_cast<std::uint64_t>(v.size()));
+			w.align();
+			w.bytes(v.data(), v.size() * sizeof(v[0]));
+		}
+		template<class TVector>
+		static bool readBlock(SnapshotReader& r, TVector& v, std::uint64_t maxSize = UINT32_MAX) {
+			std::uint64_t n = 0;
+			if (!r.value(n) || n > maxSize || !r.align())
+				return false;
+			// Grows with the data read, so a damaged size fails at the end of the stream instead of allocating it all
+			v.clear();
+			for (std::uint64_t done = 0; done < n;) {
+				const size_t k = static_cast<size_t>(std::min<std::uint64_t>(n - done, 1 << 16));
+				v.resize(done + k);
+				if (!r.bytes(v.data() + done, k * sizeof(v[0])))
+					return false;
+				done += k;
+			}
+			return true;
+		}
+
+		// Returns the number of entities that fit into a chunk of an archetype with signature 'bits'.
+		static size_t getChunkCapacity(TComponentBits const& bits) {
+			const size_t rowSize = TComponentStorage::getRowSize(bits) + sizeof(size_t);
+			return std::max<size_t>(1, chunkBytes / rowSize);
+		}
+
+		// Returns the index of the archetype with signature 'bits'. Creates it if it does not exist yet.
+		size_t getArchetype(TComponentBits const& bits, bool isPrefab) {
+			auto [it, inserted] = archetypeLookup[isPrefab].try_emplace(bits, archetypes.size());
+			if (inserted)
+				archetypes.push_back({ bits, isPrefab, getChunkCapacity(bits), std::pmr::vector<Chunk>(upstream) });
+			return it->second;
+		}
+
+		inline Chunk& getChunk(Location const& l) {
+			return archetypes[l.archetype].chunks[l.chunk];
+		}
+
+		// Returns the index of an unused entity slot, preferring recycled ones.
+		size_t createSlot() {
+			if (!freeSlots.empty()) {
+				size_t idx = freeSlots.back();
+				freeSlots.pop_back();
+				return idx;
+			}
+			entities.push_back({ { noArchetype, 0, 0 }, 0 });
+			return entities.size() - 1;
+		}
+
+		inline EntityHandle getHandle(size_t idx) const {
+			return { static_cast<std::uint32_t>(idx), entities[idx].generation };
+		}
+
+		// Returns the last chunk of archetype 'ai', or a new one if it is full.
+		Chunk& getFreeChunk(size_t ai) {
+			auto& a = archetypes[ai];
+			if (a.chunks.empty() || a.chunks.back().size() == a.chunkCapacity) {
+				Chunk& c = a.chunks.emplace_back(&chunkPool);
+				c.bits = a.bits;
+				c.cs.reserve(a.bits, a.chunkCapacity);
+				c.entityIdx.reserve(a.chunkCapacity);
+			}
+			return a.chunks.back();
+		}
+
+		// Reserves a row at the end of archetype 'ai' for the entity at 'idx'. The caller has to create its components.
+		Location allocateRow(size_t ai, size_t idx) {
+			Chunk& c = getFreeChunk(ai);
+			c.entityIdx.push_back(idx);
+			return { ai, archetypes[ai].chunks.size() - 1, c.size() - 1 };
+		}
+
+		// Removes the components at 'l' by moving the last row of the archetype into its place.
+		void eraseRow(Location const& l) {
+			auto& a = archetypes[l.archetype];
+			Chunk& last = a.chunks.back();
+			const size_t lastRow = last.size() - 1;
+			if (l.chunk != a.chunks.size() - 1 || l.row != lastRow) {
+				Chunk& c = a.chunks[l.chunk];
+				c.cs.assignComponents(l.row, last.cs, lastRow, a.bits);
+				touch(c, a.bits);
+				for (size_t i = 0; i < c.added.size(); ++i) // the moved entity may have been added recently
+					c.added[i] = std::max(c.added[i], last.added[i]);
+				const size_t moved = last.entityIdx[lastRow];
+				c.entityIdx[l.row] = moved;
+				entities[moved].loc = l;
+			}
+			last.cs.popComponents(a.bits);
+			last.entityIdx.pop_back();
+			if (last.entityIdx.empty())
+				a.chunks.pop_back();
+		}
+
+		// Moves the entity at 'idx' to the archetype with signature 'bits', keeping the components both have in common.
+		// Components that are new in 'bits' are default constructed.
+		void moveEntity(size_t idx, TComponentBits const& bits) {
+			const Location old = entities[idx].loc;
+			const TComponentBits oldBits = archetypes[old.archetype].bits;
+			if (bits == oldBits)
+				return;
+
+			const size_t ai = getArchetype(bits, archetypes[old.archetype].isPrefab);
+			const Location l = allocateRow(ai, idx);
+			Chunk& c = getChunk(l);
+			c.cs.moveComponents(getChunk(old).cs, old.row, oldBits & bits);
+			c.cs.createComponents(bits & ~oldBits);
+			touch(c, bits, bits & ~oldBits);
+			eraseRow(old);
+			entities[idx].loc = l;
 		}
 
 		// Calls 'f' once with passed 'args' and references to the specified components of the entity 'e'.
 		template<class... TAskComponents, typename... Args>
-			requires TComponentList::template is_ordered_subset<TAskComponents...>
+			requires TComponentList::template is_subset<TAskComponents...>
 		void forAllComponents(Entity& e, auto&& f, Args&&... args) {
-			const size_t idx[] = { getNumRight(e.bits, TComponentStorage::template getMask<TAskComponents>())... };
-			[&, this] <size_t... i>(std::index_sequence<i...>) {
-				f(std::forward<Args>(args)...,
-					(*static_cast<TAskComponents*>(cs.template getData<TAskComponents>(e.compIndices[idx[i]])))...);
-			}(std::make_index_sequence<sizeof...(TAskComponents)>{});
+			Chunk& c = getChunk(e.loc);
+			touch(c, TComponentStorage::template getMask<TAskComponents...>());
+			f(std::forward<Args>(args)..., *c.cs.template getData<TAskComponents>(e.loc.row)...);
 		}
 
-		inline Entity& getEntity(EntityHandle const& eh) {
-			return entities[eh.idx];
+		template<class TList>
+		struct Mask;
+		template<class... T>
+		struct Mask<TypeList<T...>> {
+			static constexpr TComponentBits value = TComponentStorage::template getMask<T...>();
+		};
+
+		// Compile-time masks of the query terms.
+		template<class... TTerms>
+		struct Match {
+			static constexpr TComponentBits include = Mask<typename Filter<TTerms...>::TWith>::value;
+			static constexpr TComponentBits exclude = Mask<typename Filter<TTerms...>::TWithout>::value;
+			static constexpr auto anyOf = []<class... TGroup>(TypeList<TGroup...>) {
+				return std::array<TComponentBits, sizeof...(TGroup)>{ Mask<TGroup>::value... };
+			}(typename Filter<TTerms...>::TAnyOf{});
+
+			static bool matches(Archetype const& a) {
+				return include.isSubsetOf(a.bits) && !exclude.intersects(a.bits) && !a.isPrefab
+					&& std::all_of(anyOf.begin(), anyOf.end(), [&a](TComponentBits const& m) { return m.intersects(a.bits); });
+			}
+
+			// Whether the components of the 'Changed' and 'Added' terms were changed or added in 'c' after tick 'since'.
+			static bool matches(Chunk const& c, std::uint32_t since) {
+				return newer(c.changed, typename Filter<TTerms...>::TChanged{}, since)
+					&& newer(c.added, typename Filter<TTerms...>::TAdded{}, since);
+			}
+
+		private:
+			template<class... T>
+			static bool newer([[maybe_unused]] Ticks const& ticks, TypeList<T...>, [[maybe_unused]] std::uint32_t since) {
+				return ((ticks[TComponentList::template index_of<T>()] > since) && ...);
+			}
+		};
+
+		// Returns the first component of the chunk, or null if an optional component is missing.
+		template<class TFetch>
+		static typename TFetch::type* getBase(Chunk& c) {
+			using T = typename TFetch::component;
+			if constexpr (TFetch::isOptional)
+				if (!c.bits.test(TComponentList::template index_of<T>()))
+					return nullptr;
+			return c.cs.template getData<T>(0);
 		}
-		inline EntityHandle getHandle(Entity const& e) {
-			return { static_cast<size_t>(&e - entities.data()) };
+
+		// Marks the components that are fetched as non-const of chunk 'c' as written.
+		template<class... TFetches>
+		void touch(TypeList<TFetches...>, Chunk& c) const {
+			constexpr TComponentBits written = (TComponentBits{} | ... |
+				(std::is_const_v<typename TFetches::type> ? TComponentBits{} : TComponentStorage::template getMask<typename TFetches::component>()));
+			if constexpr (written != TComponentBits{})
+				touch(c, c.bits & written);
 		}
 
-		void fill(TComponentBits const& bits, auto&& a) {
-			int n = std::popcount(bits);
-			int k = 0;
-			for (unsigned i = 0; i < sizeof(bits) * CHAR_BIT; ++i)
-				if (bits & (1 << i)) {
-					a[k++] = i;
-					if (k == n) return;
-				}
+		template<class... TFetches>
+		void forAllRows(TypeList<TFetches...> fetches, Chunk& c, auto&& f) {
+			touch(fetches, c);
+			const size_t n = c.size();
+			[n, &f](typename TFetches::type*... p) {
+				for (size_t i = 0; i < n; ++i)
+					f(TFetches::get(p, i)...);
+			}(getBase<TFetches>(c)...);
 		}
 
-		template<class... TCreateComponents> requires TComponentList::template is_ordered_subset<TCreateComponents...>
-		void attachComponents(Entity& e) {
-			constexpr auto sig = TComponentStorage::template getMask<TCreateComponents...>();
-			using TL = TypeList<TCreateComponents...>;
+		template<class... TFetches>
+		void forChunk(TypeList<TFetches...> fetches, Chunk& c, auto&& f) {
+			touch(fetches, c);
+			f(c.size(), TFetches::span(getBase<TFetches>(c), c.size())...);
+		}
+		template<class... TTerms>
+		void forChunk(Chunk& c, auto&& f) {
+			forChunk(typename Filter<TTerms...>::TFetches{}, c, f);
+		}
+
+		// Calls 'f' for every row of chunk 'c' with the components fetched by the query terms.
+		template<class... TTerms>
+		void forAllComponents(Chunk& c, auto&& f) {
+			forAllRows(typename Filter<TTerms...>::TFetches{}, c, f);
+		}
+
+		// The rows of all chunks of an archetype as one sequence, for 'inplace_permute'.
+		// Swapping two rows swaps all their components and the entities they belong to.
+		struct ArchetypeRows {
+			Archetype& a;
+
+			struct Row {
+				Chunk* c;
+				size_t r;
 
-			const auto n0 = e.compIndices.size();
-			const auto n1 = n0 + sizeof...(TCreateComponents);
-			e.compIndices.resize(n1);
+				friend void swap(Row x, Row y) {
+					x.c->cs.swapComponents(x.r, y.c->cs, y.r, x.c->bits);
+					std::swap(x.c->entityIdx[x.r], y.c->entityIdx[y.r]);
+				}
+			};
+
+			size_t size() const {
+				return a.chunks.empty() ? 0 : (a.chunks.size() - 1) * a.chunkCapacity + a.chunks.back().size();
+			}
+			Row operator[](size_t i) {
+				return { &a.chunks[i / a.chunkCapacity], i % a.chunkCapacity };
+			}
+		};
 
-			TL::for_each([this, &e, &n0](auto t) {
-				e.compIndices[n0 + t.i] = cs.template createComponent<typename decltype(t)::type>();
+		// Calls 'f(acc, chunk)' for all given chunks concurrently, each with its own 'acc' starting at 'init'.
+		// Then merges the results pairwise in order of the chunks: ((0 1) (2 3)) ((4 5) ...
+		template<typename T>
+		T reduceChunks(std::span<Chunk* const> chunks, T const& init, auto&& f, auto&& combine) {
+			if (chunks.empty())
+				return init;
+			Scratch scratch{ upstream };
+			std::pmr::vector<T> partials(chunks.size(), init, scratch.get());
+			getThreadPool().parallelFor(chunks.size(), [&chunks, &partials, &init, &f](size_t i) {
+				T acc = init; // written back once, so that neighbouring partials are not shared while accumulating
+				f(acc, *chunks[i]);
+				partials[i] = std::move(acc);
 				});
+			for (size_t stride = 1; stride < partials.size(); stride *= 2)
+				for (size_t i = 0; i + stride < partials.size(); i += 2 * stride)
+					partials[i] = combine(partials[i], partials[i + stride]);
+			return partials[0];
+		}
 
+		// Returns all chunks of the archetypes that match the query terms, in a vector allocated from 'mr'.
+		template<class... TTerms>
+		std::pmr::vector<Chunk*> getChunks(std::pmr::memory_resource* mr) {
+			static_assert(!Filter<TTerms...>::hasChangeFilters, "'Changed' and 'Added' need a 'Query', which remembers when it last ran.");
+			std::pmr::vector<Chunk*> chunks(mr);
+			for (auto& a : archetypes)
+				if (Match<TTerms...>::matches(a))
+					for (auto& c : a.chunks)
+						chunks.push_back(&c);
+			return chunks;
+		}
 
-			// Sort the compIndices according to the components they refer to:
-			std::vector<int> a(n1);
-			fill(e.bits, a);
-			fill(sig, a.data() + n0);
+		// Calls 'f' concurrently for every row of the given chunks.
+		template<class... TTerms>
+		void parallelForAllComponents(std::span<Chunk* const> chunks, auto&& f) {
+			getThreadPool().parallelFor(chunks.size(), [this, &chunks, &f](size_t i) {
+				forAllComponents<TTerms...>(*chunks[i], f);
+				});
+		}
+
+		inline Entity& getEntity(EntityHandle const& eh) {
+			assert(isAlive(eh));
+			return entities[eh.idx];
+		}
 
-			std::vector<int> idx(n1);
-			std::iota(idx.begin(), idx.end(), 0);
-			std::sort(idx.begin(), idx.end(), [&a](int l, int r) {return a[l] < a[r]; });
-			inplace_permute(e.compIndices, idx);
 
-			e.bits |= sig;
+	public:
+		// Takes all memory for entities and components from 'mr', which has to outlive the manager.
+		// Chunks are pooled, so destroying and creating entities does not return memory to 'mr' in between.
+		// 'mr' has to be thread-safe: queries and the scratch space of iterations, e.g. of systems run concurrently by
+		// a 'Scheduler', allocate from it at the same time. 'std::pmr::monotonic_buffer_resource' is not.
+		explicit EntityManager(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) : upstream{ mr } {}
+		EntityManager(EntityManager const&) = delete;
+		EntityManager& operator=(EntityManager const&) = delete;
+
+		// Persistent view on all entities matching the query terms. Obtained by 'EntityManager::query'.
+		// Remembers the matching archetypes, and on each use only examines the archetypes created since the last one.
+		// After a 'load' it starts over.
+		// With 'Changed' or 'Added' terms, each use only visits the chunks in which these components were written
+		// or added since the previous use, including writes by any other access through non-const components.
+		// The manager must not be moved while queries on it exist.
+		template<class... TTerms>
+		class Query {
+			EntityManager* em;
+			std::pmr::vector<size_t> matches; // indices of matching archetypes
+			size_t numChecked = 0;
+			std::uint32_t lastRun = 0; // value of 'changeTick' during the previous use
+			std::uint32_t epoch = 0;   // value of 'archetypeEpoch' when 'matches' was started
+
+			void update() {
+				if (epoch != em->archetypeEpoch) {
+					matches.clear();
+					numChecked = 0;
+					lastRun = 0;
+					epoch = em->archetypeEpoch;
+				}
+				for (; numChecked < em->archetypes.size(); ++numChecked) {
+					auto const& a = em->archetypes[numChecked];
+					if (Match<TTerms...>::matches(a))
+						matches.push_back(numChecked);
+				}
+			}
+
+			// Calls 'f' for every chunk of matching entities.
+			void forChunks(auto&& f) {
+				update();
+				for (size_t ai : matches)
+					for (auto& c : em->archetypes[ai].chunks)
+						if (!Filter<TTerms...>::hasChangeFilters || Match<TTerms...>::matches(c, lastRun))
+							f(c);
+			}
+			std::pmr::vector<Chunk*> getChunks(std::pmr::memory_resource* mr) {
+				std::pmr::vector<Chunk*> chunks(mr);
+				forChunks([&chunks](Chunk& c) { chunks.push_back(&c); });
+				return chunks;
+			}
+
+			// Writes during this use carry the tick of 'lastRun', so they are only seen by other queries.
+			void finishRun() {
+				if constexpr (Filter<TTerms...>::hasChangeFilters)
+					lastRun = em->changeTick.fetch_add(1, std::memory_order_relaxed);
+			}
+
+		public:
+			explicit Query(EntityManager& em) : em{ &em }, matches{ em.upstream } {}
+
+			// Calls 'f' for all matching entities with the fetched components.
+			void forEach(auto&& f) {
+				static_assert(Filter<TTerms...>::template is_invocable<decltype(f)>, "The callback for 'forEach' needs to take the fetched components.");
+				forChunks([this, &f](Chunk& c) { em->template forAllComponents<TTerms...>(c, f); });
+				finishRun();
+			}
+
+			// Like 'forEach', but calls 'f' concurrently on the thread pool of the manager.
+			void parallelForEach(auto&& f) {
+				static_assert(Filter<TTerms...>::template is_invocable<decltype(f)>, "The callback for 'parallelForEach' needs to take the fetched components.");
+				Scratch scratch{ em->upstream };
+				em->template parallelForAllComponents<TTerms...>(getChunks(scratch.get()), f);
+				finishRun();
+			}
+
+			// Calls 'f(n, std::span<T>...)' for every chunk of matching entities, see 'EntityManager::forEachChunk'.
+			void forEachChunk(auto&& f) {
+				static_assert(Filter<TTerms...>::template is_chunk_invocable<decltype(f)>, "The callback for 'forEachChunk' needs to take (size_t, std::span<T>...).");
+				forChunks([this, &f](Chunk& c) { em->template forChunk<TTerms...>(c, f); });
+				finishRun();
+			}
+
+			// Like 'forEachChunk', but calls 'f' concurrently on the thread pool of the manager.
+			void parallelForEachChunk(auto&& f) {
+				static_assert(Filter<TTerms...>::template is_chunk_invocable<decltype(f)>, "The callback for 'parallelForEachChunk' needs to take (size_t, std::span<T>...).");
+				Scratch scratch{ em->upstream };
+				auto chunks = getChunks(scratch.get());
+				em->getThreadPool().parallelFor(chunks.size(), [this, &chunks, &f](size_t i) {
+					em->template forChunk<TTerms...>(*chunks[i], f);
+					});
+				finishRun();
+			}
+
+			// Reduces over all matching entities, see 'EntityManager::reduceComponents'.
+			template<typename T>
+			T reduceComponents(T const& init, auto&& map, auto&& combine) {
+				static_assert(Filter<TTerms...>::template is_invocable<decltype(map)>, "The callback 'map' for 'reduceComponents' needs to take (fetched components...) and return the value to combine.");
+				Scratch scratch{ em->upstream };
+				T result = em->reduceChunks(getChunks(scratch.get()), init, [this, &map, &combine](T& acc, Chunk& c) {
+					em->template forAllComponents<TTerms...>(c, [&acc, &map, &combine](auto&&... comps) { acc = combine(acc, map(comps...)); });
+					}, combine);
+				finishRun();
+				return result;
+			}
+
+			// Returns the number of entities the next use would visit.
+			size_t size() {
+				size_t n = 0;
+				forChunks([&n](Chunk& c) { n += c.size(); });
+				return n;
+			}
+		};
+
+		// Returns a query on all entities that match the query terms.
+		template<class... TTerms>
+		Query<TTerms...> query() {
+			return Query<TTerms...>(*this);
 		}
 
+		// Records structural changes to apply later with 'EntityManager::flush', e.g. from inside an iteration callback.
+		// Component values are moved into the buffer. Entities created by a buffer get their handles on playback.
+		// A single buffer must only be used by one thread at a time, see 'EntityManager::commands'.
+		class CommandBuffer {
+			friend class EntityManager;
+			using Rows = std::array<std::uint32_t, sizeof...(TComponents)>; // one per component type
+
+			enum class Op : std::uint8_t { Destroy, Change, Create }; // in order of playback
+			struct Command {
+				Op op;
+				bool attach; // for 'Change', otherwise detach
+				EntityHandle eh;
+				TComponentBits bits;
+				Rows rows; // row in 'payload' of each component
+			};
+			std::pmr::vector<Command> commands;
+			TComponentStorage payload;
+
+			template<class... T>
+			void record(Op op, bool attach, EntityHandle eh, T&&... components) {
+				Command& c = commands.emplace_back(Command{ op, attach, eh, TComponentStorage::template getMask<std::remove_cvref_t<T>...>(), {} });
+				((c.rows[TComponentList::template index_of<std::remove_cvref_t<T>>()] =
+					static_cast<std::uint32_t>(payload.template createComponent<std::remove_cvref_t<T>>(std::forward<T>(components)))), ...);
+			}
+
+		public:
+			explicit CommandBuffer(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) : commands{ mr }, payload{ mr } {}
+
+			// Creates an entity with the given components.
+			template<class... T> requires TComponentList::template is_subset<std::remove_cvref_t<T>...>
+			void create(T&&... components) {
+				record(Op::Create, false, emptyHandle, std::forward<T>(components)...);
+			}
+
+			// Attaches the given components to the entity, or overwrites the ones it already has.
+			template<class... T> requires TComponentList::template is_subset<std::remove_cvref_t<T>...>
+			void attach(EntityHandle eh, T&&... components) {
+				record(Op::Change, true, eh, std::forward<T>(components)...);
+			}
+
+			// Removes the specified components from the entity.
+			template<class... T> requires TComponentList::template is_subset<T...>
+			void detach(EntityHandle eh) {
+				commands.push_back({ Op::Change, false, eh, TComponentStorage::template getMask<T...>(), {} });
+			}
+
+			// Destroys the entity.
+			void destroy(EntityHandle eh) {
+				commands.push_back({ Op::Destroy, false, eh, {}, {} });
+			}
+
+			size_t size() const {
+				return commands.size();
+			}
+			bool empty() const {
+				return commands.empty();
+			}
+			void clear() {
+				commands.clear();
+				payload.clear();
+			}
+		};
+
+	private:
+		std::pmr::deque<CommandBuffer> commandBuffers{ upstream }; // one per thread of the pool, with stable addresses
 
 	public:
+		// Returns the command buffer of the calling thread. Every thread of the thread pool has its own buffer,
+		// so parallel callbacks can record without locking. All threads outside the pool share one buffer.
+		CommandBuffer& commands() {
+			auto& tp = getThreadPool();
+			return commandBuffers[tp.workerIndex()];
+		}
+
+		// Plays back and clears the command buffers of all threads, see 'flush(buffers)'.
+		void flush() {
+			Scratch scratch{ upstream };
+			std::pmr::vector<CommandBuffer*> buffers(scratch.get());
+			for (auto& cb : commandBuffers)
+				buffers.push_back(&cb);
+			flush(buffers);
+		}
+
+		// Plays back and clears the given command buffers. Must not be called during an iteration.
+		// All destroys run first, then attaches and detaches in the order of the entities, then creates grouped by
+		// signature, so the new entities of an archetype fill its chunks in one go. Commands on stale handles are skipped.
+		// Changes to the same entity are applied in the order they were recorded, if they were recorded by the same buffer.
+		void flush(std::span<CommandBuffer* const> buffers) {
+			using Command = typename CommandBuffer::Command;
+			using Op = typename CommandBuffer::Op;
+			struct Ref {
+				CommandBuffer* cb;
+				Command const* c;
+				size_t seq; // order of recording, to keep the sort stable
+			};
+			Scratch scratch{ upstream };
+			std::pmr::vector<Ref> refs(scratch.get());
+			size_t numCreates = 0;
+			for (CommandBuffer* cb : buffers)
+				for (auto const& c : cb->commands) {
+					refs.push_back({ cb, &c, refs.size() });
+					numCreates += c.op == Op::Create;
+				}
+			// std::sort with a tie-break instead of std::stable_sort, which allocates outside of 'upstream'
+			std::sort(refs.begin(), refs.end(), [](Ref const& a, Ref const& b) {
+				if (a.c->op != b.c->op)
+					return a.c->op < b.c->op;
+				if (a.c->op == Op::Create ? a.c->bits != b.c->bits : a.c->eh.idx != b.c->eh.idx)
+					return a.c->op == Op::Create ? a.c->bits < b.c->bits : a.c->eh.idx < b.c->eh.idx;
+				return a.seq < b.seq;
+				});
+			if (numCreates > freeSlots.size())
+				entities.reserve(entities.size() + numCreates - freeSlots.size());
+
+			for (auto [cb, c, seq] : refs) {
+				switch (c->op) {
+				case Op::Destroy:
+					destroyEntity(c->eh);
+					break;
+				case Op::Change:
+					if (!isAlive(c->eh))
+						break;
+					if (c->attach) {
+						moveEntity(c->eh.idx, archetypes[entities[c->eh.idx].loc.archetype].bits | c->bits);
+						const Location l = entities[c->eh.idx].loc;
+						getChunk(l).cs.assignComponents(l.row, cb->payload, c->rows, c->bits);
+						touch(getChunk(l), c->bits);
+					}
+					else
+						moveEntity(c->eh.idx, archetypes[entities[c->eh.idx].loc.archetype].bits & ~c->bits);
+					break;
+				case Op::Create: {
+					const size_t idx = createSlot();
+					const Location l = allocateRow(getArchetype(c->bits, prefabbing), idx);
+					Chunk& chunk = getChunk(l);
+					chunk.cs.moveComponents(cb->payload, c->rows, c->bits);
+					touch(chunk, c->bits, c->bits);
+					entities[idx].loc = l;
+					break;
+				}
+				}
+			}
+			for (CommandBuffer* cb : buffers)
+				cb->clear();
+		}
+
+		// Returns whether 'eh' refers to an entity that has not been destroyed.
+		bool isAlive(EntityHandle const& eh) const {
+			return eh.idx < entities.size() && entities[eh.idx].generation == eh.generation
+				&& entities[eh.idx].loc.archetype != noArchetype;
+		}
+
 		// Creates 'num' new entities with the specified components.
 		// For each new entity, calls 'initFunc' with the index [0,num) and references to components.
-		template<class... TCreateComponents> requires TComponentList::template is_ordered_subset<TCreateComponents...>
+		template<class... TCreateComponents> requires TComponentList::template is_subset<TCreateComponents...>
 		void createEntities(int num, auto&& initFunc) {
 			static_assert(std::is_invocable_v<decltype(initFunc), size_t, EntityHandle, TCreateComponents&...>, "The callback for 'createEntities' needs to take (size_t, EntityHandle, TCreateComponents&...).");
-			auto n0 = entities.size();
-			entities.resize(n0 + num);
-			for (size_t i = 0; i < num; ++i) {
-				Entity& e = entities[n0 + i];
-				e.isPrefab = prefabbing;
-				attachComponents<TCreateComponents...>(e);
-				forAllComponents<TCreateComponents...>(e, initFunc, i, EntityHandle{ n0 + i });
+			constexpr auto sig = TComponentStorage::template getMask<TCreateComponents...>();
+			const size_t ai = getArchetype(sig, prefabbing);
+			const size_t n = std::max(num, 0);
+			if (n > freeSlots.size())
+				entities.reserve(entities.size() + n - freeSlots.size());
+
+			// Fill the archetype chunk by chunk, constructing the components of each chunk in one go.
+			for (size_t i = 0; i < n;) {
+				Chunk& c = getFreeChunk(ai);
+				const size_t ci = archetypes[ai].chunks.size() - 1;
+				const size_t r0 = c.size();
+				const size_t k = std::min(n - i, archetypes[ai].chunkCapacity - r0);
+				c.cs.template createComponents<TCreateComponents...>(k);
+				touch(c, sig, sig);
+				[&, this](TCreateComponents*... p) {
+					for (size_t r = r0; r < r0 + k; ++r, ++i) {
+						const size_t idx = createSlot();
+						c.entityIdx.push_back(idx);
+						entities[idx].loc = { ai, ci, r };
+						initFunc(i, getHandle(idx), Fetch<TCreateComponents, false>::get(p, r)...);
+					}
+				}(c.cs.template getData<TCreateComponents>(0)...);
 			}
 		}
 
-		// Calls 'f' for all entities with references to the specified components.
-		template<class... TAskComponents>
+		// Calls 'f' for all entities that match the query terms, with the fetched components.
+		// E.g. forAllComponents<A, Without<B>, Optional<C>>([](A& a, C* c){}) visits all entities with A but without B.
+		// forAllComponents<A, AnyOf<B, C>>([](A& a){}) visits those with A and B, C or both.
+		template<class... TTerms>
 		void forAllComponents(auto&& f) {
-			static_assert(TComponentList::template is_ordered_subset<TAskComponents...>, "Component types must be an ordered subset.");
-			static_assert(std::is_invocable_v<decltype(f), TAskComponents&...>, "The callback for 'forAllComponents' needs to take (TAskComponents&...).");
-			constexpr TComponentBits ask = TComponentStorage::template getMask<TAskComponents...>();
-			for (auto& e : entities)
-				if (!(ask & ~e.bits) && !e.isPrefab)
-					forAllComponents<TAskComponents...>(e, std::forward<decltype(f)>(f));
+			static_assert(Filter<TTerms...>::template is_invocable<decltype(f)>, "The callback for 'forAllComponents' needs to take (T&...) for required and (T*...) for optional components.");
+			static_assert(!Filter<TTerms...>::hasChangeFilters, "'Changed' and 'Added' need a 'Query', which remembers when it last ran.");
+			for (auto& a : archetypes)
+				if (Match<TTerms...>::matches(a))
+					for (auto& c : a.chunks)
+						forAllComponents<TTerms...>(c, f);
+		}
+
+		// Like 'forAllComponents', but calls 'f' concurrently on the thread pool, one chunk per task.
+		// 'f' must not create, change or destroy entities.
+		template<class... TTerms>
+		void parallelForAllComponents(auto&& f) {
+			static_assert(Filter<TTerms...>::template is_invocable<decltype(f)>, "The callback for 'parallelForAllComponents' needs to take (T&...) for required and (T*...) for optional components.");
+			Scratch scratch{ upstream };
+			parallelForAllComponents<TTerms...>(getChunks<TTerms...>(scratch.get()), f);
+		}
+
+		// Calls 'f(n, std::span<T>...)' for every chunk that matches the query terms, with one span of 'n' contiguous
+		// components per fetched component. Tags and missing optional components give empty spans.
+		// E.g. forEachChunk<A, B>([](size_t n, std::span<A> a, std::span<B> b){ for (size_t i = 0; i < n; ++i) ... }).
+		// 'f' must not create or destroy entities or change their components.
+		template<class... TTerms>
+		void forEachChunk(auto&& f) {
+			static_assert(Filter<TTerms...>::template is_chunk_invocable<decltype(f)>, "The callback for 'forEachChunk' needs to take (size_t, std::span<T>...).");
+			static_assert(!Filter<TTerms...>::hasChangeFilters, "'Changed' and 'Added' need a 'Query', which remembers when it last ran.");
+			for (auto& a : archetypes)
+				if (Match<TTerms...>::matches(a))
+					for (auto& c : a.chunks)
+						forChunk<TTerms...>(c, f);
+		}
+
+		// Like 'forEachChunk', but calls 'f' concurrently on the thread pool, one chunk per task.
+		template<class... TTerms>
+		void parallelForEachChunk(auto&& f) {
+			static_assert(Filter<TTerms...>::template is_chunk_invocable<decltype(f)>, "The callback for 'parallelForEachChunk' needs to take (size_t, std::span<T>...).");
+			Scratch scratch{ upstream };
+			auto chunks = getChunks<TTerms...>(scratch.get());
+			getThreadPool().parallelFor(chunks.size(), [this, &chunks, &f](size_t i) {
+				forChunk<TTerms...>(*chunks[i], f);
+				});
+		}
+
+		// Reduces over all entities that match the query terms. Every entity is mapped to a value with 'map(components...)',
+		// and the values are merged with 'combine(a, b)', starting from 'init', which has to be neutral for 'combine'.
+		// Chunks are reduced concurrently and their results merged in a fixed tree, so the result only depends on the
+		// order of the entities and not on the threads. E.g. floating point sums are reproducible bit for bit.
+		template<class... TTerms, typename T>
+		T reduceComponents(T const& init, auto&& map, auto&& combine) {
+			static_assert(Filter<TTerms...>::template is_invocable<decltype(map)>, "The callback 'map' for 'reduceComponents' needs to take (fetched components...) and return the value to combine.");
+			Scratch scratch{ upstream };
+			return reduceChunks(getChunks<TTerms...>(scratch.get()), init, [this, &map, &combine](T& acc, Chunk& c) {
+				forAllComponents<TTerms...>(c, [&acc, &map, &combine](auto&&... comps) { acc = combine(acc, map(comps...)); });
+				}, combine);
+		}
+
+		// Reorders the entities of every archetype that matches the query terms by 'key(fetched components...)', ascending.
+		// The order holds across all chunks of an archetype, entities with equal keys keep their order.
+		// E.g. sortComponents<const transform>([](transform const& tr){ return morton(...); }) groups entities by space.
+		// Handles stay valid, but components move like with structural changes. Sorted chunks count as changed.
+		template<class... TTerms>
+		void sortComponents(auto&& key) {
+			static_assert(Filter<TTerms...>::template is_invocable<decltype(key)>, "The callback for 'sortComponents' needs to take the fetched components and return a key that is ordered by '<'.");
+			static_assert(!Filter<TTerms...>::hasChangeFilters, "'Changed' and 'Added' need a 'Query', which remembers when it last ran.");
+			using TKey = typename Filter<TTerms...>::template invoke_result_t<decltype(key)>;
+			for (size_t ai = 0; ai < archetypes.size(); ++ai) {
+				Archetype& a = archetypes[ai];
+				if (!Match<TTerms...>::matches(a))
+					continue;
+				ArchetypeRows rows{ a };
+				const size_t n = rows.size();
+				Scratch scratch{ upstream };
+				std::pmr::vector<TKey> keys(scratch.get());
+				keys.reserve(n);
+				for (auto& c : a.chunks)
+					forAllComponents<TTerms...>(c, [&keys, &key](auto&&... comps) { keys.push_back(key(comps...)); });
+				if (std::is_sorted(keys.begin(), keys.end()))
+					continue;
+
+				// Row k takes the entity from row order[k]
+				std::pmr::vector<size_t> order(n, scratch.get());
+				std::iota(order.begin(), order.end(), size_t{ 0 });
+				std::sort(order.begin(), order.end(), [&keys](size_t x, size_t y) { // stable, without a buffer from outside 'upstream'
+					return keys[x] < keys[y] || (!(keys[y] < keys[x]) && x < y);
+					});
+				inplace_permute(rows, order);
+
+				// Entities may have moved to chunks with older 'added' ticks
+				Ticks added{};
+				for (auto const& c : a.chunks)
+					for (size_t i = 0; i < added.size(); ++i)
+						added[i] = std::max(added[i], c.added[i]);
+				for (size_t ci = 0; ci < a.chunks.size(); ++ci) {
+					Chunk& c = a.chunks[ci];
+					c.added = added;
+					touch(c, c.bits);
+					for (size_t r = 0; r < c.size(); ++r)
+						entities[c.entityIdx[r]].loc = { ai, ci, r };
+				}
+			}
+		}
+
+		// Sets the thread pool used by the parallel functions. The pool must outlive this manager.
+		void setThreadPool(ThreadPool& tp) {
+			pool = &tp;
+			while (commandBuffers.size() < tp.size())
+				commandBuffers.emplace_back(upstream);
+		}
+		ThreadPool& getThreadPool() {
+			if (!pool) {
+				ownPool = std::make_unique<ThreadPool>();
+				setThreadPool(*ownPool);
+			}
+			return *pool;
 		}
 
 		// Calls 'f' once with passed 'args' and references to the specified components of the entity handle 'handle'.
+		// Returns false without calling 'f' if the handle is stale or the entity lacks any of the components.
 		template<class... TAskComponents, typename... Args>
-		void forAllComponents(EntityHandle const& eh, auto&& f, Args&&... args) {
+		bool forAllComponents(EntityHandle const& eh, auto&& f, Args&&... args) {
 			static_assert(std::is_invocable_v<decltype(f), Args..., TAskComponents&...>, "The callback for 'forAllComponents' needs to take (Args&&..., TAskComponents&...).");
+			if (!isAlive(eh) || !TComponentStorage::template getMask<TAskComponents...>().isSubsetOf(archetypes[entities[eh.idx].loc.archetype].bits))
+				return false;
 			forAllComponents<TAskComponents...>(getEntity(eh), std::forward<decltype(f)>(f), std::forward<decltype(args)>(args)...);
+			return true;
 		}
 
-		// Adds the specified components to the entity behind the handle. Calls 'initFunc' with the new components
-		template<class... TCreateComponents> requires TComponentList::template is_ordered_subset<TCreateComponents...>
-		void attachComponents(EntityHandle handle, auto&& initFunc) {
+		// Adds the specified components to the entity behind the handle. Calls 'initFunc' with the new components.
+		// Returns false if the handle is stale.
+		template<class... TCreateComponents> requires TComponentList::template is_subset<TCreateComponents...>
+		bool attachComponents(EntityHandle handle, auto&& initFunc) {
+			if (!isAlive(handle))
+				return false;
 			auto& e = getEntity(handle);
-			attachComponents<TCreateComponents...>(e);
+			moveEntity(handle.idx, archetypes[e.loc.archetype].bits | TComponentStorage::template getMask<TCreateComponents...>());
 			forAllComponents<TCreateComponents...>(e, initFunc);
+			return true;
+		}
+
+		// Removes the specified components from the entity behind the handle. Returns false if the handle is stale.
+		template<class... TRemoveComponents> requires TComponentList::template is_subset<TRemoveComponents...>
+		bool detachComponents(EntityHandle handle) {
+			if (!isAlive(handle))
+				return false;
+			auto& e = entities[handle.idx];
+			moveEntity(handle.idx, archetypes[e.loc.archetype].bits & ~TComponentStorage::template getMask<TRemoveComponents...>());
+			return true;
+		}
+
+		// Destroys the entity behind the handle and recycles its slot. Returns false if the handle is stale.
+		bool destroyEntity(EntityHandle handle) {
+			if (!isAlive(handle))
+				return false;
+			auto& e = entities[handle.idx];
+			eraseRow(e.loc);
+			e.loc.archetype = noArchetype;
+			++e.generation;
+			freeSlots.push_back(handle.idx);
+			return true;
+		}
+
+		// Creates a prefab with the specified components and calls 'initFunc' with references to them.
+		// Prefabs are stored in archetypes of their own, which iterations and queries never visit.
+		template<class... TCreateComponents> requires TComponentList::template is_subset<TCreateComponents...>
+		EntityHandle createPrefab(auto&& initFunc) {
+			static_assert(std::is_invocable_v<decltype(initFunc), TCreateComponents&...>, "The callback for 'createPrefab' needs to take (TCreateComponents&...).");
+			constexpr auto sig = TComponentStorage::template getMask<TCreateComponents...>();
+			const size_t idx = createSlot();
+			const Location l = allocateRow(getArchetype(sig, true), idx);
+			Chunk& c = getChunk(l);
+			c.cs.template createComponents<TCreateComponents...>(1);
+			touch(c, sig, sig);
+			entities[idx].loc = l;
+			initFunc(*c.cs.template getData<TCreateComponents>(l.row)...);
+			return getHandle(idx);
+		}
+
+		// Returns whether the entity behind the handle is a prefab. Stale handles are not.
+		bool isPrefab(EntityHandle const& eh) {
+			return isAlive(eh) && archetypes[getEntity(eh).loc.archetype].isPrefab;
+		}
+
+		// Creates 'num' regular entities with copies of the components of 'prefab', which may be any entity.
+		// The copies are made chunk by chunk. Then calls 'initFunc' for each new entity with the index [0,num),
+		// its handle and references to the components 'TInitComponents', which the prefab must have.
+		// Returns false without creating anything if the handle of the prefab is stale or the prefab lacks any of them.
+		template<class... TInitComponents> requires TComponentList::template is_subset<TInitComponents...>
+		bool instantiate(EntityHandle const& prefab, int num, auto&& initFunc) {
+			static_assert(std::is_invocable_v<decltype(initFunc), size_t, EntityHandle, TInitComponents&...>, "The callback for 'instantiate' needs to take (size_t, EntityHandle, TInitComponents&...).");
+			if (!isAlive(prefab))
+				return false;
+			constexpr auto initBits = TComponentStorage::template getMask<TInitComponents...>();
+			const Location src = getEntity(prefab).loc;
+			const TComponentBits bits = archetypes[src.archetype].bits;
+			if (!initBits.isSubsetOf(bits))
+				return false;
+			const size_t ai = getArchetype(bits, false);
+			const size_t n = std::max(num, 0);
+			if (n > freeSlots.size())
+				entities.reserve(entities.size() + n - freeSlots.size());
+
+			for (size_t i = 0; i < n;) {
+				Chunk& c = getFreeChunk(ai);
+				const size_t ci = archetypes[ai].chunks.size() - 1;
+				const size_t r0 = c.size();
+				const size_t k = std::min(n - i, archetypes[ai].chunkCapacity - r0);
+				c.cs.copyComponents(getChunk(src).cs, src.row, bits, k); // looked up again, 'getFreeChunk' may move chunks
+				touch(c, bits, bits);
+				[&, this](TInitComponents*... p) {
+					for (size_t r = r0; r < r0 + k; ++r, ++i) {
+						const size_t idx = createSlot();
+						c.entityIdx.push_back(idx);
+						entities[idx].loc = { ai, ci, r };
+						initFunc(i, getHandle(idx), Fetch<TInitComponents, false>::get(p, r)...);
+					}
+				}(c.cs.template getData<TInitComponents>(0)...);
+			}
+			return true;
 		}
 
 		// Adds a new entity whose components are copies of the componenets behind 'handle'.
+		// Returns 'emptyHandle' if the handle is stale.
 		EntityHandle duplicateEntity(EntityHandle const& handle) {
-			Entity& e = entities.emplace_back(getEntity(handle));
-			e.isPrefab = prefabbing;
+			if (!isAlive(handle))
+				return emptyHandle;
+			const Location src = getEntity(handle).loc;
+			const TComponentBits bits = archetypes[src.archetype].bits;
+			const size_t ai = getArchetype(bits, prefabbing);
+			const size_t idx = createSlot();
+			const Location l = allocateRow(ai, idx);
+			getChunk(l).cs.copyComponents(getChunk(src).cs, src.row, bits); // the chunk is reserved, so 'src' stays valid
+			touch(getChunk(l), bits, bits);
+			entities[idx].loc = l;
+			return getHandle(idx);
+		}
 
-			size_t i = 0;
-			TComponentList::for_each([this, &e, &i](auto t) {
-				using T = typename decltype(t)::type;
-				if (e.bits & cs.getMask<T>()) {
-					auto old = *(cs.template getData<T>(e.compIndices[i])); // temporarily save the old object because createComponent resizes.
-					e.compIndices[i++] = cs.template createComponent<T>(std::move(old));
+		// Returns the number of living entities.
+		size_t size() const {
+			return entities.size() - freeSlots.size();
+		}
+
+		// Writes all entities and components to a versioned binary snapshot, in the byte order of this machine.
+		// Trivially copyable components are stored as raw blocks aligned to 64 bytes, all others through 'Serializer'.
+		void save(std::ostream& out) const {
+			SnapshotWriter w{ out };
+			w.bytes(snapshotMagic, sizeof(snapshotMagic));
+			w.value(snapshotVersion);
+			writeLayout(w);
+			w.value(static_cast<std::uint8_t>(prefabbing));
+
+			Scratch scratch{ upstream };
+			std::pmr::vector<SavedEntity> saved(entities.size(), scratch.get());
+			for (size_t i = 0; i < entities.size(); ++i)
+				saved[i] = { entities[i].loc.archetype, entities[i].loc.chunk, entities[i].loc.row, entities[i].generation, 0 };
+			writeBlock(w, saved);
+			writeBlock(w, freeSlots);
+
+			w.value(static_cast<std::uint64_t>(archetypes.size()));
+			for (auto const& a : archetypes) {
+				for (size_t i = 0; i < a.bits.numWords(); ++i)
+					w.value(a.bits.word(i));
+				w.value(static_cast<std::uint64_t>(a.isPrefab));
+				w.value(static_cast<std::uint64_t>(a.chunkCapacity));
+				w.value(static_cast<std::uint64_t>(a.chunks.size()));
+				for (auto const& c : a.chunks) {
+					writeBlock(w, c.entityIdx);
+					c.cs.save(w, a.bits);
 				}
-				});
+			}
+		}
+		bool save(std::string const& path) const {
+			std::ofstream out(path, std::ios::binary);
+			if (!out)
+				return false;
+			save(out);
+			return bool(out);
+		}
+
+		// Replaces all entities with those of a snapshot written by 'save'. Returns false and leaves the manager
+		// unchanged if the snapshot is damaged, has another version or was written for other component types.
+		// Component blocks are read straight into the chunks.
+		bool load(std::istream& in) {
+			SnapshotReader r{ in };
+			char magic[sizeof(snapshotMagic)];
+			std::uint32_t version = 0;
+			std::uint8_t savedPrefabbing = 0;
+			if (!r.bytes(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), snapshotMagic)
+				|| !r.value(version) || version != snapshotVersion || !readLayout(r) || !r.value(savedPrefabbing))
+				return false;
+
+			Scratch scratch{ upstream };
+			std::pmr::vector<SavedEntity> saved(scratch.get());
+			std::pmr::vector<std::uint32_t> newFreeSlots(upstream);
+			if (!readBlock(r, saved) || !readBlock(r, newFreeSlots))
+				return false;
+
+			std::uint64_t numArchetypes = 0;
+			if (!r.value(numArchetypes))
+				return false;
+			std::pmr::vector<Archetype> newArchetypes(upstream);
+			for (std::uint64_t ai = 0; ai < numArchetypes; ++ai) {
+				TComponentBits bits;
+				for (size_t i = 0; i < bits.numWords(); ++i) {
+					std::uint64_t word;
+					if (!r.value(word))
+						return false;
+					bits.setWord(i, word);
+				}
+				std::uint64_t isPrefab, capacity, numChunks;
+				if (!r.value(isPrefab) || !r.value(capacity) || !r.value(numChunks) || !bits.isSubsetOf(~TComponentBits{})
+					|| capacity == 0 || capacity > getChunkCapacity(bits))
+					return false;
+				auto& a = newArchetypes.emplace_back(Archetype{ bits, isPrefab != 0, static_cast<size_t>(capacity), std::pmr::vector<Chunk>(upstream) });
+				for (std::uint64_t ci = 0; ci < numChunks; ++ci) {
+					Chunk& c = a.chunks.emplace_back(&chunkPool);
+					c.bits = a.bits;
+					c.cs.reserve(a.bits, capacity);
+					c.entityIdx.reserve(capacity);
+					if (!readBlock(r, c.entityIdx, capacity) || !c.cs.load(r, a.bits, c.size()))
+						return false;
+					if (c.size() == 0 || (ci + 1 < numChunks && c.size() != capacity)) // all chunks but the last are full
+						return false;
+					for (size_t idx : c.entityIdx)
+						if (idx >= saved.size())
+							return false;
+				}
+			}
 
-			return getHandle(e);
+			std::pmr::vector<Entity> newEntities(saved.size(), upstream);
+			size_t numAlive = 0;
+			for (size_t i = 0; i < saved.size(); ++i) {
+				auto const& e = saved[i];
+				if (e.archetype != noArchetype && (e.archetype >= newArchetypes.size() || e.chunk >= newArchetypes[e.archetype].chunks.size()
+					|| e.row >= newArchetypes[e.archetype].chunks[e.chunk].size()))
+					return false;
+				newEntities[i] = { { e.archetype, e.chunk, e.row }, e.generation };
+				numAlive += e.archetype != noArchetype;
+			}
+
+			// Every signature has one archetype, every row has to belong to the entity that points to it,
+			// and every entity to exactly one row
+			Lookup newLookup[2]{ Lookup(upstream), Lookup(upstream) };
+			size_t numRows = 0;
+			for (size_t ai = 0; ai < newArchetypes.size(); ++ai) {
+				if (!newLookup[newArchetypes[ai].isPrefab].try_emplace(newArchetypes[ai].bits, ai).second)
+					return false;
+				for (size_t ci = 0; ci < newArchetypes[ai].chunks.size(); ++ci) {
+					auto const& c = newArchetypes[ai].chunks[ci];
+					for (size_t row = 0; row < c.size(); ++row) {
+						auto const& l = newEntities[c.entityIdx[row]].loc;
+						if (l.archetype != ai || l.chunk != ci || l.row != row)
+							return false;
+					}
+					numRows += c.size();
+				}
+			}
+			if (numRows != numAlive)
+				return false;
+
+			// Free slots have to be unused and listed once
+			std::pmr::vector<bool> isFree(saved.size(), false, scratch.get());
+			for (std::uint32_t idx : newFreeSlots) {
+				if (idx >= saved.size() || isFree[idx] || newEntities[idx].loc.archetype != noArchetype)
+					return false;
+				isFree[idx] = true;
+			}
+
+			entities = std::move(newEntities);
+			freeSlots = std::move(newFreeSlots);
+			archetypes = std::move(newArchetypes);
+			++archetypeEpoch;
+			for (int i = 0; i < 2; ++i)
+				archetypeLookup[i] = std::move(newLookup[i]);
+			for (auto& a : archetypes)
+				for (auto& c : a.chunks)
+					touch(c, c.bits, c.bits);
+			prefabbing = savedPrefabbing != 0;
+			return true;
+		}
+		bool load(std::string const& path) {
+			std::ifstream in(path, std::ios::binary);
+			return in && load(in);
 		}
 
+		// Whether 'createEntities' and 'duplicateEntity' create prefabs, see 'createPrefab'.
 		bool prefabbing = true;
 		void setPrefabbing(bool b) {
 			prefabbing = b;
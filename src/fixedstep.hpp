@@ -0,0 +1,132 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cmath>
+#include <utility>
+
+// Runs a simulation with a fixed time step on its own thread.
+// Steps are taken as real time passes. After every batch of steps, 'publish' is called with the time of the new state.
+// If the simulation falls behind by more than 'maxSteps' steps, the rest is dropped instead of caught up,
+// so that a slow step can not snowball.
+class FixedStepLoop {
+	using Clock = std::chrono::steady_clock;
+
+	double stepTime;
+	int maxSteps;
+	Clock::time_point startTime = Clock::now();
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+	std::atomic<std::uint64_t> steps{0};
+	std::atomic<std::uint64_t> droppedSteps{0};
+
+	void run(std::function<void(float)> step, std::function<void(double)> publish){
+		double simTime = 0; // time of the current state
+		while(!stopping.load()){
+			const double now = time();
+			int n = 0;
+			while(simTime + stepTime <= now && n < maxSteps){
+				step((float)stepTime);
+				simTime += stepTime;
+				++n;
+			}
+			if(simTime + stepTime <= now){
+				const double behind = std::floor((now - simTime) / stepTime);
+				droppedSteps += (std::uint64_t)behind;
+				simTime += behind * stepTime;
+			}
+			if(n > 0){
+				steps += n;
+				publish(simTime);
+			}
+			std::this_thread::sleep_until(startTime + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(simTime + stepTime)));
+		}
+	}
+
+public:
+	FixedStepLoop(double hz, int maxSteps = 5) : stepTime{1. / hz}, maxSteps{maxSteps}{}
+	~FixedStepLoop(){
+		stop();
+	}
+
+	// Starts the simulation thread. 'step(dt)' advances the simulation, 'publish(time)' hands its state to others.
+	void start(std::function<void(float)> step, std::function<void(double)> publish){
+		stop();
+		stopping = false;
+		startTime = Clock::now();
+		thread = std::thread([this, step = std::move(step), publish = std::move(publish)]() mutable {
+			run(std::move(step), std::move(publish));
+		});
+	}
+	// Returns after the current batch of steps.
+	void stop(){
+		stopping = true;
+		if(thread.joinable())
+			thread.join();
+	}
+
+	// Seconds since 'start', on the same clock as the times passed to 'publish'.
+	double time() const{
+		return std::chrono::duration<double>(Clock::now() - startTime).count();
+	}
+	double getStepTime() const{
+		return stepTime;
+	}
+	std::uint64_t getSteps() const{
+		return steps.load();
+	}
+	std::uint64_t getDroppedSteps() const{
+		return droppedSteps.load();
+	}
+};
+
+// Hands states from one writer thread to one reader thread. Neither waits for the other longer than a swap.
+// The writer fills 'write()' and publishes it. The reader keeps the two most recent states it picked up,
+// so it can interpolate between them.
+template<class T>
+class StateBuffer {
+public:
+	struct State {
+		T value{};
+		double time = 0;
+		std::uint64_t seq = 0; // 0 until published
+	};
+
+private:
+	std::mutex mutex;
+	State back;         // owned by the writer
+	State latest;       // guarded by 'mutex'
+	State prev, curr;   // owned by the reader
+	std::uint64_t seq = 0;
+
+public:
+	// Writer: the state to fill before the next 'publish'. It holds an old state, which has to be overwritten.
+	T& write(){
+		return back.value;
+	}
+	void publish(double time){
+		back.time = time;
+		back.seq = ++seq;
+		std::lock_guard lk(mutex);
+		std::swap(back, latest);
+	}
+
+	// Reader: picks up the newest published state. Returns false if there was none since the last call.
+	bool update(){
+		std::lock_guard lk(mutex);
+		if(latest.seq <= curr.seq)
+			return false;
+		std::swap(prev, curr);
+		std::swap(curr, latest);
+		return true;
+	}
+	State const& previous() const{
+		return prev;
+	}
+	State const& current() const{
+		return curr;
+	}
+};
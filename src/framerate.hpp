@@ -1,51 +1,124 @@
 #pragma once
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <array>
+#include <span>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
 
+// Paces a loop to a target frame rate and keeps statistics of the frame times it delivers.
+// Sleeps until shortly before the end of a frame and spins on a monotonic clock for the rest,
+// since sleeping alone overshoots by the granularity of the scheduler.
 class FrameLimiter {
-	double targetFPS;
-	double adjustment;
-	std::chrono::high_resolution_clock hrc;
-	decltype(hrc.now()) lastTime = hrc.now();
+	using Clock = std::chrono::steady_clock;
+
+public:
+	static constexpr float bucketWidth = 1e-4f; // seconds per bucket of the histogram
+	static constexpr size_t numBuckets = 1000;  // the last bucket also counts all longer frames
+
+	struct Stats {
+		std::uint64_t frames;
+		float p50, p99, max; // seconds
+	};
+
+private:
+	Clock::duration period;
+	Clock::duration spinTime = std::chrono::milliseconds(1);
+	Clock::time_point lastTime = Clock::now();
+	Clock::time_point deadline = lastTime;
 
 	std::vector<float> frameTimes;
 	float accFrameTime;
 	int currentFrameTime;
 
+	std::array<std::uint64_t, numBuckets> histogram{};
+	std::uint64_t numFrames = 0;
+	float maxFrameTime = 0;
+
+	static float seconds(Clock::duration d){
+		return std::chrono::duration<float>(d).count();
+	}
+
+	void record(float dt){
+		++histogram[std::min(numBuckets - 1, (size_t)(dt / bucketWidth))];
+		++numFrames;
+		maxFrameTime = std::max(maxFrameTime, dt);
+	}
+
 public:
-	FrameLimiter(float targetFPS, int nFrameTimes = 10) : targetFPS{targetFPS}{
+	FrameLimiter(float targetFPS, int nFrameTimes = 10)
+		: period{std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1. / targetFPS))}{
 		frameTimes.resize(nFrameTimes, 0);
 	}
 
-	// Should be called once before the first 'frame'.
+	// Should be called once before the first 'frame'. Also resets the statistics.
 	void start() {
-		lastTime = hrc.now();
-		adjustment = 0;
+		lastTime = deadline = Clock::now();
 		accFrameTime = 0;
 		currentFrameTime = 0;
+		std::fill(frameTimes.begin(), frameTimes.end(), 0.f);
+		histogram.fill(0);
+		numFrames = 0;
+		maxFrameTime = 0;
 	}
 
-	// Signals the beginning of a new frame. Returns the used time since last frame.
-	// 'dt' is set to the time, the game should be advanced with.
+	// Time before the end of a frame that is spun instead of slept. Zero only sleeps.
+	void setSpinTime(Clock::duration d){
+		spinTime = d;
+	}
+
+	// Signals the beginning of a new frame. Waits for the end of the current one and returns its duration,
+	// which is the time the game should be advanced with.
+	// A frame that took longer than the target does not make the next ones shorter.
 	float frame(){
-		using namespace std::chrono;
-		auto currentTime = hrc.now();
-		float dt = (float)duration_cast<nanoseconds>(currentTime - lastTime).count() / 1e9;
-		accFrameTime += dt - frameTimes[currentFrameTime];
-		frameTimes[currentFrameTime] = dt;
+		auto now = Clock::now();
+		float used = seconds(now - lastTime);
+		accFrameTime += used - frameTimes[currentFrameTime];
+		frameTimes[currentFrameTime] = used;
 		++currentFrameTime %= frameTimes.size();
-		std::this_thread::sleep_for(nanoseconds((long long)((1. / targetFPS - dt + adjustment) * 1e9)));
-		std::this_thread::yield();
-		currentTime = hrc.now();
-		dt = (float)duration_cast<nanoseconds>(currentTime - lastTime).count() / 1e9;
-		lastTime = currentTime;
-		adjustment += (1. / targetFPS - dt) * 0.5;
 
+		deadline += period;
+		if(deadline < now)
+			deadline = now;
+		if(deadline - now > spinTime)
+			std::this_thread::sleep_until(deadline - spinTime);
+		while((now = Clock::now()) < deadline){}
+
+		float dt = seconds(now - lastTime);
+		lastTime = now;
+		record(dt);
 		return dt;
 	}
 
+	// Returns the average time used by the last frames, without waiting.
 	float getFrameTime(){
 		return accFrameTime / (float)frameTimes.size();
 	}
 
+	// Returns the duration that 'p' of all frames since 'start' did not exceed, e.g. 0.99.
+	// Accurate to 'bucketWidth'.
+	float percentile(float p) const{
+		if(numFrames == 0)
+			return 0;
+		const std::uint64_t rank = std::max<std::uint64_t>(1, (std::uint64_t)std::ceil(p * (double)numFrames));
+		std::uint64_t count = 0;
+		for(size_t i = 0; i < numBuckets - 1; ++i){
+			count += histogram[i];
+			if(count >= rank)
+				return std::min(maxFrameTime, (i + 1) * bucketWidth);
+		}
+		return maxFrameTime;
+	}
+
+	Stats getStats() const{
+		return {numFrames, percentile(0.5f), percentile(0.99f), maxFrameTime};
+	}
+
+	// Number of frames per duration, bucket i counts [i, i+1) * 'bucketWidth'.
+	std::span<const std::uint64_t, numBuckets> getHistogram() const{
+		return histogram;
+	}
+
 };
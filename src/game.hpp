@@ -3,9 +3,17 @@
 #include "ecs.hpp"
 #include "timer.hpp"
 #include "colour.hpp"
+#include "integrator.hpp"
+#include "scheduler.hpp"
+#include "fixedstep.hpp"
 
 #include <execution>
 #include <random>
+#include <atomic>
+#include <cstdint>
+#include <array>
+#include <span>
+#include <limits>
 
 using namespace ecs;
 float dot(sf::Vector2f const& a, sf::Vector2f const& b){
@@ -44,6 +52,9 @@ struct ball{
 
 // Specify once which components there are
 using MyEntityManager = EntityManager<transform, physics, render>;
+// Queries through which the systems access the balls, see 'Game::load'
+using MovingBalls = MyEntityManager::Query<transform, physics>;
+using ObservedBalls = MyEntityManager::Query<const transform, const physics>;
 
 // Global world properties
 struct {
@@ -54,23 +65,81 @@ struct {
 
 
 // Define some systems:
+
+// Draws balls from copies of their components, at positions interpolated between two states of the simulation.
 class Renderer {
 	sf::CircleShape shape;
 
-public:
-	void update(MyEntityManager& em, sf::RenderWindow& window){
-
-		AutoTimer at(g_timer, _FUNC_);
-		em.forAllComponents<transform, render>([this, &window](transform& tr, render& re) {
-			shape.setRadius(re.radius);
-			shape.setOrigin(re.radius, re.radius);
-			shape.setFillColor(re.colour);
-			shape.setPosition(tr.pos);
-			window.draw(shape);
+	// Batched mode: every ball becomes a fan of triangles in one vertex array, drawn with a single call.
+	static constexpr size_t circlePoints = 16;
+	static constexpr size_t verticesPerBall = 3 * circlePoints;
+	static constexpr size_t blockSize = 1024; // balls per parallel task
+	sf::VertexArray vertices{sf::Triangles};
+	std::array<sf::Vector2f, circlePoints + 1> unitCircle;
+
+	// Input of the current 'update'
+	std::span<const transform> prev, cur;
+	std::span<const render> res;
+	float alpha;
+
+	sf::Vector2f position(size_t i) const{
+		return prev[i].pos + (cur[i].pos - prev[i].pos) * alpha;
+	}
+
+	void fill(size_t begin, size_t end){
+		sf::Vertex* v = &vertices[begin * verticesPerBall];
+		for(size_t i = begin; i < end; ++i){
+			const sf::Vector2f centre = position(i);
+			const float r = res[i].radius;
+			const sf::Color col = res[i].colour;
+			for(size_t k = 0; k < circlePoints; ++k){
+				*v++ = sf::Vertex(centre, col);
+				*v++ = sf::Vertex(centre + r*unitCircle[k], col);
+				*v++ = sf::Vertex(centre + r*unitCircle[k+1], col);
+			}
+		}
+	}
+
+	void updateBatched(ThreadPool& tp, sf::RenderWindow& window){
+		const size_t num = cur.size();
+		vertices.resize(num * verticesPerBall);
+		if(num == 0)
+			return;
+		tp.parallelFor((num + blockSize - 1) / blockSize, [this, num](size_t b) {
+			fill(b * blockSize, std::min(num, (b + 1) * blockSize));
 		});
+		window.draw(vertices);
+	}
+
+public:
+	bool batched = true;
+
+	Renderer(){
+		for(size_t k = 0; k <= circlePoints; ++k){
+			const float a = 2*3.14159265f*k/circlePoints;
+			unitCircle[k] = {std::cos(a), std::sin(a)};
+		}
+	}
+
+	// Draws ball i at 'prevTrs[i]' for 'a' = 0 and at 'trs[i]' for 'a' = 1.
+	// Without a matching previous state, 'prevTrs' is ignored.
+	void update(ThreadPool& tp, sf::RenderWindow& window, std::span<const transform> prevTrs, std::span<const transform> trs,
+				std::span<const render> renders, float a){
+
+		AUTO_TIMER(g_timer, _FUNC_);
+		prev = prevTrs.size() == trs.size() ? prevTrs : trs;
+		cur = trs;
+		res = renders;
+		alpha = a;
+		if(batched){
+			updateBatched(tp, window);
+			return;
+		}
+		for(size_t i = 0; i < cur.size(); ++i)
+			draw(window, transform{position(i)}, res[i]);
 	}
 
-	void draw(sf::RenderWindow& window, transform& tr, render& re){
+	void draw(sf::RenderWindow& window, transform const& tr, render const& re){
 		shape.setRadius(re.radius);
 		shape.setOrigin(re.radius, re.radius);
 		shape.setFillColor(re.colour);
@@ -96,21 +165,21 @@ class MotionSolver {
 		ph.acc += acc;
 	}
 
-	void updatePositions(MyEntityManager& em, float dt){
-		em.forAllComponents<transform, physics>([this, dt](transform& tr, physics& ph) {
+	void updatePositions(MovingBalls& q, float dt){
+		q.parallelForEach([this, dt](transform& tr, physics& ph) {
 			updatePosition(tr, ph, dt);
 		});
 	}
-	void applyGravity(MyEntityManager& em){
-		em.forAllComponents<physics>([this](physics& ph) {
+	void applyGravity(MovingBalls& q){
+		q.parallelForEach([this](transform&, physics& ph) {
 			accelerate(ph, world.gravity);
 			if(std::abs(ph.oldPos.x) < 0.05)
 				accelerate(ph, -3.f*world.gravity);
 			//accelerate(ph, (ph.oldPos.x<0?-1.f:1.f)*sf::Vector2f{ph.oldPos.y, -ph.oldPos.x} * 1.5f);
 		});
 	}
-	void applyConstraint(MyEntityManager& em, float dt){
-		em.forAllComponents<transform, physics>([this, dt](transform& tr, physics& ph) {
+	void applyConstraint(MovingBalls& q, float dt){
+		q.parallelForEach([this, dt](transform& tr, physics& ph) {
 			auto conn = tr.pos - world.bowlCentre;
 			auto dist = length(conn);
 			if(dist > world.bowlRadius - ph.radius){
@@ -138,11 +207,161 @@ class MotionSolver {
 		});
 	}
 
+	// Does the same as the three passes above in one pass per chunk, see 'integrator::stepFused' and 'integrator::stepTransposed'.
+	void updateFused(MovingBalls& q, float dt){
+		const integrator::World w{world.gravity.x, world.gravity.y, world.bowlCentre.x, world.bowlCentre.y, world.bowlRadius, dt};
+		if (mode == Mode::Vectorized){
+			q.parallelForEachChunk([this, &w](size_t n, std::span<transform> trs, std::span<physics> phs){
+				integrator::stepTransposed(n, trs, phs, w, isa);
+			});
+			return;
+		}
+		q.parallelForEachChunk([&w](size_t n, std::span<transform> trs, std::span<physics> phs){
+			integrator::stepFused(n, trs, phs, w);
+		});
+	}
+
+	integrator::Isa isa = integrator::bestIsa();
+
 public:
-	void update(MyEntityManager& em, float dt) {
-		applyGravity(em);
-		applyConstraint(em, dt);
-		updatePositions(em, dt);
+	// Passes: one pass over all balls per force. Fused: everything in one pass per chunk.
+	// Vectorized: like fused, but on split copies of each chunk with SIMD instructions, which is slower for these components.
+	enum class Mode { Passes, Fused, Vectorized };
+	Mode mode = Mode::Fused;
+
+	void update(MovingBalls& q, float dt) {
+		AUTO_TIMER(g_timer, _FUNC_);
+		if (mode != Mode::Passes){
+			updateFused(q, dt);
+			return;
+		}
+		applyGravity(q);
+		applyConstraint(q, dt);
+		updatePositions(q, dt);
+	}
+};
+
+// Resolves contacts between balls.
+// Every step the balls are binned into a uniform grid by a parallel counting sort over a hashed cell table,
+// so each ball is only tested against the balls in its 3x3 neighbourhood of cells.
+// Contacts are solved Jacobi-style: every ball sums up its own corrections, so balls can be processed in parallel.
+class CollisionSolver {
+	static constexpr size_t blockSize = 1024; // balls per parallel task
+
+	// Snapshot of all balls of the current step.
+	std::vector<transform*> trs;
+	std::vector<physics*> phs;
+	std::vector<sf::Vector2f> pos, vel, dPos, dVel;
+	std::vector<float> radius, mass, restitution;
+
+	// Grid
+	std::vector<std::int32_t> cellX, cellY;
+	std::vector<std::uint32_t> bucket;      // hashed cell of each ball
+	std::vector<std::uint32_t> bucketStart; // start of each bucket in 'sorted', plus the end
+	std::vector<std::uint32_t> cursor;
+	std::vector<std::uint32_t> sorted;      // balls ordered by bucket
+	float cellSize = 1;
+	std::uint32_t mask = 0;
+
+	static std::uint32_t hash(std::int32_t x, std::int32_t y, std::uint32_t mask){
+		return ((std::uint32_t)x * 73856093u ^ (std::uint32_t)y * 19349663u) & mask;
+	}
+
+	// Calls 'f(i)' for all balls, in blocks on the thread pool.
+	void forAllBalls(ThreadPool& tp, auto&& f){
+		const size_t n = trs.size();
+		tp.parallelFor((n + blockSize - 1) / blockSize, [n, &f](size_t b){
+			for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); ++i)
+				f(i);
+		});
+	}
+
+	void gather(MovingBalls& q){
+		trs.clear(); phs.clear(); pos.clear(); vel.clear(); radius.clear(); mass.clear(); restitution.clear();
+		q.forEach([this](transform& tr, physics& ph){
+			trs.push_back(&tr);
+			phs.push_back(&ph);
+			pos.push_back(tr.pos);
+			vel.push_back(ph.vel);
+			radius.push_back(ph.radius);
+			mass.push_back(ph.mass > 0 ? ph.mass : ph.radius * ph.radius); // balls of equal density by default
+			restitution.push_back(ph.restitution);
+		});
+		const size_t n = trs.size();
+		dPos.assign(n, {0, 0});
+		dVel.assign(n, {0, 0});
+		cellX.resize(n);
+		cellY.resize(n);
+		bucket.resize(n);
+		sorted.resize(n);
+	}
+
+	void buildGrid(ThreadPool& tp){
+		const size_t n = trs.size();
+		cellSize = 2 * std::max(1e-6f, *std::max_element(radius.begin(), radius.end()));
+		mask = std::bit_ceil(std::max<std::uint32_t>(n, 2)) - 1;
+		bucketStart.assign(mask + 2, 0);
+
+		// Count the balls per bucket
+		forAllBalls(tp, [this](size_t i){
+			cellX[i] = (std::int32_t)std::floor(pos[i].x / cellSize);
+			cellY[i] = (std::int32_t)std::floor(pos[i].y / cellSize);
+			bucket[i] = hash(cellX[i], cellY[i], mask);
+			std::atomic_ref<std::uint32_t>(bucketStart[bucket[i] + 1]).fetch_add(1, std::memory_order_relaxed);
+		});
+		std::inclusive_scan(bucketStart.begin(), bucketStart.end(), bucketStart.begin());
+
+		// Scatter, then sort each bucket so that the result does not depend on the scheduling
+		cursor.assign(bucketStart.begin(), bucketStart.end() - 1);
+		forAllBalls(tp, [this](size_t i){
+			sorted[std::atomic_ref<std::uint32_t>(cursor[bucket[i]]).fetch_add(1, std::memory_order_relaxed)] = i;
+		});
+		const size_t numBlocks = (mask + blockSize) / blockSize;
+		tp.parallelFor(numBlocks, [this](size_t b){
+			for (size_t k = b * blockSize; k < std::min<size_t>(mask + 1, (b + 1) * blockSize); ++k)
+				if (bucketStart[k + 1] - bucketStart[k] > 1)
+					std::sort(sorted.begin() + bucketStart[k], sorted.begin() + bucketStart[k + 1]);
+		});
+	}
+
+	// Sums up the corrections of ball 'i' from all overlapping balls.
+	void resolve(size_t i){
+		for (std::int32_t y = cellY[i] - 1; y <= cellY[i] + 1; ++y)
+			for (std::int32_t x = cellX[i] - 1; x <= cellX[i] + 1; ++x){
+				const std::uint32_t b = hash(x, y, mask);
+				for (std::uint32_t k = bucketStart[b]; k < bucketStart[b + 1]; ++k){
+					const std::uint32_t j = sorted[k];
+					if (j == i || cellX[j] != x || cellY[j] != y) // other balls in the same bucket
+						continue;
+					auto conn = pos[i] - pos[j];
+					float distsq = lengthsq(conn);
+					float minDist = radius[i] + radius[j];
+					if (distsq >= minDist * minDist || distsq < 1e-12f)
+						continue;
+					float dist = std::sqrt(distsq);
+					sf::Vector2f n = conn / dist;
+					float share = mass[j] / (mass[i] + mass[j]);
+					dPos[i] += n * ((minDist - dist) * share);
+
+					float vn = dot(vel[i] - vel[j], n);
+					if (vn < 0) // approaching
+						dVel[i] -= n * ((1 + std::min(restitution[i], restitution[j])) * vn * share);
+				}
+			}
+	}
+
+public:
+	void update(MovingBalls& q, ThreadPool& tp){
+		AUTO_TIMER(g_timer, _FUNC_);
+		gather(q);
+		if (trs.empty())
+			return;
+		buildGrid(tp);
+		forAllBalls(tp, [this](size_t i){ resolve(i); });
+		forAllBalls(tp, [this](size_t i){
+			trs[i]->pos += dPos[i];
+			phs[i]->vel += dVel[i];
+		});
 	}
 };
 
@@ -150,22 +369,28 @@ class Logger{
 	bool activated = false;
 	float time = 0;
 	float energy; // per mass
+
+	// Diagnostics over all balls
+	struct Sums {
+		float energy = 0;
+		float maxY = -std::numeric_limits<float>::infinity();
+	};
 public:
 	float getEnergy() const{return energy;}
-	void update(MyEntityManager& em, float dt){
+	void update(ObservedBalls& q, float dt){
 		time += dt;
-		energy = 0;
-		em.forAllComponents<transform, physics>([this](transform& tr, physics& ph){
-			if(tr.pos.y > 600 && ! activated){
-				activated = true;
-				std::cout << "Hit the bottom at " << time <<std::endl;
-			}
-			//std::cout << "transform address " << &tr << std::endl;
-			energy += -dot(world.gravity, tr.pos) + lengthsq(ph.vel) / 2.f;
-		});
-//		em.forAllComponents<render>([this](render& re){
-//			//	std::cout << "render address " << &re << std::endl;
-//		});
+		const Sums sums = q.reduceComponents(Sums{},
+			[](transform const& tr, physics const& ph){
+				return Sums{-dot(world.gravity, tr.pos) + lengthsq(ph.vel) / 2.f, tr.pos.y};
+			},
+			[](Sums const& a, Sums const& b){
+				return Sums{a.energy + b.energy, std::max(a.maxY, b.maxY)};
+			});
+		energy = sums.energy;
+		if(sums.maxY > 600 && ! activated){
+			activated = true;
+			std::cout << "Hit the bottom at " << time <<std::endl;
+		}
 	}
 };
 
@@ -179,11 +404,52 @@ class Game{
 
 	MyEntityManager em;
 	MotionSolver solver;
+	CollisionSolver collider;
 	Renderer renderer;
 	Logger logger;
+	Scheduler<MyEntityManager, float> scheduler{em}; // systems of a simulation step, taking dt
+
+	// What the render thread needs of a state of the simulation.
+	struct Frame {
+		std::vector<transform> trs;
+		std::vector<struct render> res;
+		float energy = 0;
+		std::uint64_t order = 0; // changes whenever the balls are reordered
+	};
+	FixedStepLoop sim;
+	StateBuffer<Frame> frames;
+
+	static constexpr std::uint64_t sortInterval = 64; // steps
+	std::uint64_t numSteps = 0;
+	std::uint64_t numSorts = 0;
 
 	std::vector<ball> balls;
 
+	// Orders the balls along a Z-order curve, so that neighbours in the bowl are mostly neighbours in memory.
+	void sortBySpace(){
+		AUTO_TIMER(g_timer, _FUNC_);
+		++numSorts;
+		auto cell = [](float v){ return (std::uint32_t)std::clamp((v + 1.f) * 32767.5f, 0.f, 65535.f); }; // [-1,1]
+		em.sortComponents<const transform>([&cell](transform const& tr){
+			return ecs::morton(cell(tr.pos.x), cell(tr.pos.y));
+		});
+	}
+
+	// Copies the current state for the render thread.
+	void publish(double time){
+		AUTO_TIMER(g_timer, _FUNC_);
+		Frame& f = frames.write();
+		f.trs.clear();
+		f.res.clear();
+		em.forEachChunk<const transform, const struct render>([&f](size_t, std::span<const transform> trs, std::span<const struct render> res) {
+			f.trs.insert(f.trs.end(), trs.begin(), trs.end());
+			f.res.insert(f.res.end(), res.begin(), res.end());
+		});
+		f.energy = logger.getEnergy();
+		f.order = numSorts;
+		frames.publish(time);
+	}
+
 public:
 	int load(){
 
@@ -197,11 +463,15 @@ public:
 		std::uniform_real_distribution<float> urd(0.002,0.02);
 		std::mt19937 mt;
 
-		// Create the entities
+		// Create the entities from a prefab
 		const int num = 100;
 		em.setPrefabbing(false);
-		em.createEntities<struct transform,struct physics,struct render>(num,
-            [&](int i, ecs::EntityHandle eh, struct transform& tr,struct physics& ph, struct render& re){
+		auto ballPrefab = em.createPrefab<struct transform,struct physics,struct render>(
+			[](struct transform& tr,struct physics& ph, struct render& re){
+				ph.restitution = 0.9;
+			});
+		em.instantiate<struct transform,struct physics,struct render>(ballPrefab, num,
+            [&](size_t i, ecs::EntityHandle eh, struct transform& tr,struct physics& ph, struct render& re){
                 ph.oldPos = tr.pos = world.bowlCentre+
 						world.bowlRadius*sf::Vector2f{((float)i/(num-1)-0.5f)*2.f*0.9f, -0.5};
 
@@ -209,7 +479,6 @@ public:
                 unsigned char hue = (float)i/num*255;
                 auto rgb = HsvToRgb({hue,150,255});
                 re.colour = sf::Color(rgb.r,rgb.g,rgb.b);
-	            ph.restitution = 0.9;
             });
 
 //
@@ -254,20 +523,60 @@ public:
 //		});
 
 
+		// Each system works on the results of the one before, so they run in order. Their passes run in parallel.
+		scheduler.add<transform, physics>("motion", [this](MovingBalls& q, float dt){ solver.update(q, dt); });
+		scheduler.add<transform, physics>("collision", [this](MovingBalls& q, float){ collider.update(q, em.getThreadPool()); });
+		scheduler.add<const transform, const physics>("logger", [this](ObservedBalls& q, float dt){ logger.update(q, dt); });
+		scheduler.addExclusive("sort", [this](float){
+			if(++numSteps % sortInterval == 0)
+				sortBySpace();
+		});
+
 		return 0;
 	}
+	// Writes the world to a snapshot file, or replaces it by one.
+	bool saveWorld(std::string const& path) const {
+		return em.save(path);
+	}
+	bool loadWorld(std::string const& path){
+		return em.load(path);
+	}
+
+	// 'hz' simulation steps per second, catching up at most 'maxSteps' at once.
+	explicit Game(double hz = 240, int maxSteps = 5) : sim{hz, maxSteps}{}
+	~Game(){
+		stop();
+	}
+
+	// Runs the simulation on its own thread until 'stop'. The world must not be touched in between, except by 'render'.
+	void start(){
+		em.getThreadPool(); // shared with the render thread, so create it before
+		publish(0);
+		sim.start([this](float dt){ move(dt); }, [this](double time){ publish(time); });
+	}
+	void stop(){
+		sim.stop();
+	}
+
 	void move(float dt){
-		solver.update(em, dt);
-		logger.update(em, dt);
+		AUTO_TIMER(g_timer, _FUNC_);
+		scheduler.run(em.getThreadPool(), dt);
 	}
+	// Draws the simulation as it was one step ago, interpolated between the two latest states.
 	void render(sf::RenderWindow& window, float frameTime){
-		AutoTimer at(g_timer, _FUNC_);
+		AUTO_TIMER(g_timer, _FUNC_);
+		frames.update();
+		auto const& prev = frames.previous();
+		auto const& cur = frames.current();
+		const double t = sim.time() - sim.getStepTime();
+		const float alpha = cur.time > prev.time ? (float)std::clamp((t - prev.time) / (cur.time - prev.time), 0., 1.) : 1.f;
 
-		// Draw all balls
-		renderer.update(em, window);
+		// Draw all balls. After a reordering, the previous state holds the balls at other indices.
+		auto const& from = prev.value.order == cur.value.order ? prev.value.trs : cur.value.trs;
+		renderer.update(em.getThreadPool(), window, from, cur.value.trs, cur.value.res, alpha);
 
 		{
-			AutoTimer at(g_timer, "conv render");
+			AUTO_TIMER(g_timer, "conv render");
 			std::for_each(std::execution::par, balls.begin(), balls.end(),
 						  [this, &window](ball& ba) {
 				renderer.draw(window, ba.tr, ba.re);
@@ -286,7 +595,7 @@ public:
 
 
 		// Draw some text
-		text.setString(std::to_string(logger.getEnergy()));
+		text.setString(std::to_string(cur.value.energy));
 		text.setPosition(0,0.46);
 		text.setOrigin(text.getLocalBounds().getSize()/2.f);
 		window.draw(text);
@@ -0,0 +1,80 @@
+#include "integrator.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define INTEGRATOR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace integrator {
+
+	Isa bestIsa() {
+#ifdef INTEGRATOR_X86
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] >= 7) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) // AVX2, also needs OS support for the ymm registers
+				if ((_xgetbv(0) & 6) == 6)
+					return Isa::AVX2;
+		}
+		return Isa::SSE;
+#else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return Isa::AVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return Isa::SSE;
+#endif
+#endif
+		return Isa::Scalar;
+	}
+
+	void step(Bodies const& b, World const& w, Isa isa) {
+		switch (isa) {
+		case Isa::AVX2: stepAVX2(b, w); break;
+		case Isa::SSE: stepSSE(b, w); break;
+		default: stepScalar(b, w, 0, b.n); break;
+		}
+	}
+
+	void stepScalar(Bodies const& b, World const& w, size_t begin, size_t end) {
+		stepKernel<ScalarOps>(b, w, begin, end);
+	}
+
+#ifdef INTEGRATOR_X86
+	struct SSEOps {
+		using F = __m128;
+		using M = __m128;
+		static constexpr size_t width = 4;
+
+		static F load(const float* p) { return _mm_loadu_ps(p); }
+		static void store(float* p, F a) { _mm_storeu_ps(p, a); }
+		static F set(float a) { return _mm_set1_ps(a); }
+		static F add(F a, F b) { return _mm_add_ps(a, b); }
+		static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+		static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+		static F div(F a, F b) { return _mm_div_ps(a, b); }
+		static F sqrt(F a) { return _mm_sqrt_ps(a); }
+		static F abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+		static M gt(F a, F b) { return _mm_cmpgt_ps(a, b); }
+		static M lt(F a, F b) { return _mm_cmplt_ps(a, b); }
+		static bool any(M m) { return _mm_movemask_ps(m) != 0; }
+		static F select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	};
+
+	void stepSSE(Bodies const& b, World const& w) {
+		const size_t n = b.n - b.n % SSEOps::width;
+		stepKernel<SSEOps>(b, w, 0, n);
+		stepScalar(b, w, n, b.n);
+	}
+#else
+	void stepSSE(Bodies const& b, World const& w) {
+		stepScalar(b, w, 0, b.n);
+	}
+#endif
+
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstddef>
+#include <cmath>
+#include <span>
+#include <vector>
+
+// Motion of balls in a bowl: gravity, the bowl constraint and the drift-kick-drift step in one pass.
+// The kernel works on split x/y float arrays, so batches of balls can be processed with SIMD instructions.
+// The instruction set is chosen at runtime, see 'bestIsa'.
+// 'stepFused' and 'stepTransposed' run it on runs of components with the fields of the game's 'transform' and 'physics'.
+namespace integrator {
+
+	// Split x/y arrays of 'n' balls. Updated in place, except 'radius' and 'restitution'.
+	struct Bodies {
+		size_t n;
+		float* px, * py;
+		float* vx, * vy;
+		float* ax, * ay;
+		float* oldAx, * oldAy;
+		float* oldPx, * oldPy;
+		float* oldVx, * oldVy;
+		float* velimX, * velimY;
+		const float* radius;
+		const float* restitution;
+	};
+
+	struct World {
+		float gx, gy;
+		float bowlX, bowlY;
+		float bowlRadius;
+		float dt;
+	};
+
+	enum class Isa { Scalar, SSE, AVX2 };
+
+	// Returns the widest instruction set supported by this CPU.
+	Isa bestIsa();
+
+	// Advances all bodies by one step using the given instruction set.
+	void step(Bodies const& b, World const& w, Isa isa = bestIsa());
+
+	void stepScalar(Bodies const& b, World const& w, size_t begin, size_t end);
+	void stepSSE(Bodies const& b, World const& w);
+	void stepAVX2(Bodies const& b, World const& w);
+
+
+	// Operations on plain floats. The vector types of the SIMD variants provide the same interface.
+	struct ScalarOps {
+		using F = float;
+		using M = bool;
+		static constexpr size_t width = 1;
+
+		static F load(const float* p) { return *p; }
+		static void store(float* p, F a) { *p = a; }
+		static F set(float a) { return a; }
+		static F add(F a, F b) { return a + b; }
+		static F sub(F a, F b) { return a - b; }
+		static F mul(F a, F b) { return a * b; }
+		static F div(F a, F b) { return a / b; }
+		static F sqrt(F a) { return std::sqrt(a); }
+		static F abs(F a) { return std::abs(a); }
+		static M gt(F a, F b) { return a > b; }
+		static M lt(F a, F b) { return a < b; }
+		static bool any(M m) { return m; }
+		static F select(M m, F a, F b) { return m ? a : b; } // m ? a : b
+	};
+
+	// The same computation as the per-entity passes of 'MotionSolver', for balls [begin,end) in steps of V::width.
+	template<class V>
+	inline void stepKernel(Bodies const& b, World const& w, size_t begin, size_t end) {
+		using F = typename V::F;
+		const F gx = V::set(w.gx), gy = V::set(w.gy);
+		const F bx = V::set(w.bowlX), by = V::set(w.bowlY);
+		const F bowlRadius = V::set(w.bowlRadius);
+		const F dt = V::set(w.dt), halfDt = V::set(w.dt / 2);
+		const F zero = V::set(0), half = V::set(0.5f), two = V::set(2), minV2 = V::set(1e-6f);
+		const F centreWidth = V::set(0.05f), centreBoost = V::set(-3);
+
+		for (size_t i = begin; i + V::width <= end; i += V::width) {
+			F px = V::load(b.px + i), py = V::load(b.py + i);
+			F vx = V::load(b.vx + i), vy = V::load(b.vy + i);
+
+			// gravity, with an upwards push near the centre
+			auto centre = V::lt(V::abs(V::load(b.oldPx + i)), centreWidth);
+			F ax = V::add(V::load(b.ax + i), gx);
+			F ay = V::add(V::load(b.ay + i), gy);
+			ax = V::select(centre, V::add(ax, V::mul(centreBoost, gx)), ax);
+			ay = V::select(centre, V::add(ay, V::mul(centreBoost, gy)), ay);
+
+			// bowl constraint
+			const F r = V::load(b.radius + i);
+			const F cx = V::sub(px, bx), cy = V::sub(py, by);
+			const F dist = V::sqrt(V::add(V::mul(cx, cx), V::mul(cy, cy)));
+			const F limit = V::sub(bowlRadius, r);
+			auto outside = V::gt(dist, limit);
+			if (V::any(outside)) {
+				const F e = V::load(b.restitution + i);
+				const F nx = V::div(cx, dist), ny = V::div(cy, dist);
+				const F vn = V::add(V::mul(vx, nx), V::mul(vy, ny));
+				const F vtx = V::sub(vx, V::mul(vn, nx)), vty = V::sub(vy, V::mul(vn, ny));
+				const F vt2 = V::add(V::mul(vtx, vtx), V::mul(vty, vty));
+
+				const F npx = V::add(bx, V::mul(nx, limit)), npy = V::add(by, V::mul(ny, limit));
+				F nvx = V::sub(vtx, V::mul(V::mul(vn, nx), e));
+				F nvy = V::sub(vty, V::mul(V::mul(vn, ny), e));
+
+				// conserve energy
+				const F absv2 = V::add(V::mul(nvx, nvx), V::mul(nvy, nvy));
+				const F ekin0 = V::add(vt2, V::mul(V::mul(vn, vn), e));
+				const F e0 = V::add(V::sub(zero, V::add(V::mul(gx, px), V::mul(gy, py))), V::mul(ekin0, half));
+				const F v2 = V::abs(V::mul(two, V::add(e0, V::add(V::mul(gx, npx), V::mul(gy, npy)))));
+				auto moving = V::gt(absv2, minV2);
+				const F scale = V::select(moving, V::sqrt(V::div(v2, V::select(moving, absv2, minV2))), V::set(1));
+				nvx = V::mul(nvx, scale);
+				nvy = V::mul(nvy, scale);
+
+				px = V::select(outside, npx, px);
+				py = V::select(outside, npy, py);
+				vx = V::select(outside, nvx, vx);
+				vy = V::select(outside, nvy, vy);
+			}
+
+			// drift-kick-drift
+			V::store(b.oldPx + i, px);
+			V::store(b.oldPy + i, py);
+			V::store(b.oldVx + i, vx);
+			V::store(b.oldVy + i, vy);
+			const F velimX = V::add(vx, V::mul(V::load(b.oldAx + i), halfDt));
+			const F velimY = V::add(vy, V::mul(V::load(b.oldAy + i), halfDt));
+			V::store(b.velimX + i, velimX);
+			V::store(b.velimY + i, velimY);
+			V::store(b.px + i, V::add(px, V::mul(velimX, dt)));
+			V::store(b.py + i, V::add(py, V::mul(velimY, dt)));
+			V::store(b.vx + i, V::add(velimX, V::mul(ax, halfDt)));
+			V::store(b.vy + i, V::add(velimY, V::mul(ay, halfDt)));
+			V::store(b.oldAx + i, ax);
+			V::store(b.oldAy + i, ay);
+			V::store(b.ax + i, zero);
+			V::store(b.ay + i, zero);
+		}
+	}
+
+	// One ball through the scalar kernel, read from and written back to its components.
+	template<class TTransform, class TPhysics>
+	inline void stepBall(TTransform& tr, TPhysics& ph, World const& w) {
+		float px = tr.pos.x, py = tr.pos.y, vx = ph.vel.x, vy = ph.vel.y, ax = ph.acc.x, ay = ph.acc.y;
+		float oldAx = ph.oldAcc.x, oldAy = ph.oldAcc.y, oldPx = ph.oldPos.x, oldPy = 0, oldVx = 0, oldVy = 0, velimX = 0, velimY = 0;
+		const Bodies b{ 1, &px, &py, &vx, &vy, &ax, &ay, &oldAx, &oldAy, &oldPx, &oldPy, &oldVx, &oldVy, &velimX, &velimY, &ph.radius, &ph.restitution };
+		stepKernel<ScalarOps>(b, w, 0, 1);
+		tr.pos.x = px; tr.pos.y = py;
+		ph.vel.x = vx; ph.vel.y = vy;
+		ph.acc.x = ax; ph.acc.y = ay;
+		ph.oldAcc.x = oldAx; ph.oldAcc.y = oldAy;
+		ph.oldPos.x = oldPx; ph.oldPos.y = oldPy;
+		ph.oldVel.x = oldVx; ph.oldVel.y = oldVy;
+		ph.velim.x = velimX; ph.velim.y = velimY;
+	}
+
+	// Advances the first 'n' balls in place, one at a time. Needs no copies, but is not vectorized.
+	template<class TTransform, class TPhysics>
+	void stepFused(size_t n, std::span<TTransform> trs, std::span<TPhysics> phs, World const& w) {
+		for (size_t i = 0; i < n; ++i)
+			stepBall(trs[i], phs[i], w);
+	}
+
+	// Split x/y copies of a run of balls, for 'stepTransposed'.
+	struct Batch {
+		std::vector<float> px, py, vx, vy, ax, ay, oldAx, oldAy, oldPx, oldPy, oldVx, oldVy, velimX, velimY, radius, restitution;
+
+		Bodies resize(size_t n) {
+			for (auto* v : { &px, &py, &vx, &vy, &ax, &ay, &oldAx, &oldAy, &oldPx, &oldPy, &oldVx, &oldVy, &velimX, &velimY, &radius, &restitution })
+				v->resize(n);
+			return { n, px.data(), py.data(), vx.data(), vy.data(), ax.data(), ay.data(), oldAx.data(), oldAy.data(),
+					oldPx.data(), oldPy.data(), oldVx.data(), oldVy.data(), velimX.data(), velimY.data(), radius.data(), restitution.data() };
+		}
+	};
+
+	// Advances the first 'n' balls by copying them into split arrays, running 'step' with 'isa' and copying them back.
+	// The copies cost more than the SIMD instructions save on components stored as x/y pairs, so 'stepFused' is faster there.
+	template<class TTransform, class TPhysics>
+	void stepTransposed(size_t n, std::span<TTransform> trs, std::span<TPhysics> phs, World const& w, Isa isa = bestIsa()) {
+		thread_local Batch batch;
+		const Bodies b = batch.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			auto const& tr = trs[i];
+			auto const& ph = phs[i];
+			batch.px[i] = tr.pos.x; batch.py[i] = tr.pos.y;
+			batch.vx[i] = ph.vel.x; batch.vy[i] = ph.vel.y;
+			batch.ax[i] = ph.acc.x; batch.ay[i] = ph.acc.y;
+			batch.oldAx[i] = ph.oldAcc.x; batch.oldAy[i] = ph.oldAcc.y;
+			batch.oldPx[i] = ph.oldPos.x;
+			batch.radius[i] = ph.radius;
+			batch.restitution[i] = ph.restitution;
+		}
+		step(b, w, isa);
+		for (size_t i = 0; i < n; ++i) {
+			auto& tr = trs[i];
+			auto& ph = phs[i];
+			tr.pos.x = batch.px[i]; tr.pos.y = batch.py[i];
+			ph.vel.x = batch.vx[i]; ph.vel.y = batch.vy[i];
+			ph.acc.x = batch.ax[i]; ph.acc.y = batch.ay[i];
+			ph.oldAcc.x = batch.oldAx[i]; ph.oldAcc.y = batch.oldAy[i];
+			ph.oldPos.x = batch.oldPx[i]; ph.oldPos.y = batch.oldPy[i];
+			ph.oldVel.x = batch.oldVx[i]; ph.oldVel.y = batch.oldVy[i];
+			ph.velim.x = batch.velimX[i]; ph.velim.y = batch.velimY[i];
+		}
+	}
+
+}
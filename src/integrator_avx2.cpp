@@ -0,0 +1,48 @@
+// Compiled with AVX2 enabled. Only called if 'bestIsa' reports AVX2 support.
+#include "integrator.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace integrator {
+
+	namespace { // keeps the AVX2 instantiations out of other translation units
+
+	struct AVX2Ops {
+		using F = __m256;
+		using M = __m256;
+		static constexpr size_t width = 8;
+
+		static F load(const float* p) { return _mm256_loadu_ps(p); }
+		static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+		static F set(float a) { return _mm256_set1_ps(a); }
+		static F add(F a, F b) { return _mm256_add_ps(a, b); }
+		static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+		static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+		static F div(F a, F b) { return _mm256_div_ps(a, b); }
+		static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+		static F abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+		static M gt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+		static M lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static bool any(M m) { return _mm256_movemask_ps(m) != 0; }
+		static F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+	};
+
+	}
+
+	void stepAVX2(Bodies const& b, World const& w) {
+		const size_t n = b.n - b.n % AVX2Ops::width;
+		stepKernel<AVX2Ops>(b, w, 0, n);
+		stepScalar(b, w, n, b.n);
+	}
+
+}
+#else
+namespace integrator {
+
+	void stepAVX2(Bodies const& b, World const& w) {
+		stepSSE(b, w);
+	}
+
+}
+#endif
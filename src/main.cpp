@@ -3,8 +3,32 @@
 #include "game.hpp"
 #include "framerate.hpp"
 
+#include <cstdlib>
+
+
+// Options:
+//   --trace        write the timeline of the last frames to 'trace.json' on exit
+//   --load <file>  start from a snapshot instead of the initial scene
+//   --save <file>  write a snapshot of the world on exit
+//   --hz <n>       simulation steps per second (default 240)
+int main(int argc, char** argv){
+	bool trace = false;
+	double hz = 240;
+	std::string loadPath, savePath;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--trace")
+			trace = true;
+		else if (arg == "--load" && i + 1 < argc)
+			loadPath = argv[++i];
+		else if (arg == "--save" && i + 1 < argc)
+			savePath = argv[++i];
+		else if (arg == "--hz" && i + 1 < argc)
+			hz = std::max(1., std::atof(argv[++i]));
+	}
+	if (trace)
+		g_timer.enableTracing(1 << 16);
 
-int main(){
 	sf::ContextSettings settings(0,0,8); // 8x antialiasing
 
 	sf::RenderWindow window(sf::VideoMode(1200, 1000), "Entity Component System - Test",
@@ -16,13 +40,17 @@ int main(){
 	window.setView(view);
 
 
-	Game game;
+	Game game(hz);
 	game.load();
+	if (!loadPath.empty() && !game.loadWorld(loadPath))
+		std::cerr << "Could not load the snapshot " << loadPath << std::endl;
 
+	// The simulation runs on its own thread at a fixed rate, this one only renders.
+	game.start();
 	FrameLimiter fl(120);
 	fl.start();
 	while (window.isOpen()){
-		float dt = fl.frame();
+		fl.frame();
 
 		// Process events
 		sf::Event event;
@@ -35,14 +63,21 @@ int main(){
 		// Clear screen
 		window.clear();
 
-		game.move(dt);
 		game.render(window, fl.getFrameTime());
 
 		// Update the window
 		window.display();
 
 	}
+	game.stop();
 	g_timer.print();
+	const auto stats = fl.getStats();
+	std::cout << stats.frames << " frames, p50 " << stats.p50 * 1e3f << " ms, p99 " << stats.p99 * 1e3f
+			  << " ms, max " << stats.max * 1e3f << " ms" << std::endl;
+	if (trace)
+		g_timer.writeTrace("trace.json");
+	if (!savePath.empty() && !game.saveWorld(savePath))
+		std::cerr << "Could not save the snapshot " << savePath << std::endl;
 
 	return 0;
 }
\ No newline at end of file
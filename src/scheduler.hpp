@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+
+#include "ecs.hpp"
+#include "threadpool.hpp"
+
+namespace ecs {
+
+	// The components a system reads and writes through a query with the terms 'TTerms'. As in queries, fetched
+	// components are written unless asked for as 'const T', and 'Changed' and 'Added' read the change ticks of theirs.
+	// 'Without' and 'AnyOf' only depend on the archetypes, which only exclusive systems change.
+	template<class TComponentStorage, class... TTerms>
+	struct SystemAccess {
+		using TComponentBits = typename TComponentStorage::TComponentBits;
+		using TFilter = Filter<TTerms...>;
+
+		template<class TFetch>
+		static constexpr TComponentBits mask(bool isConst) {
+			return std::is_const_v<typename TFetch::type> == isConst ? TComponentStorage::template getMask<typename TFetch::component>() : TComponentBits{};
+		}
+		template<class... T>
+		static constexpr TComponentBits mask(TypeList<T...>) {
+			return TComponentStorage::template getMask<T...>();
+		}
+
+		static constexpr TComponentBits reads = []<class... TF>(TypeList<TF...>) {
+			return ((mask(typename TFilter::TChanged{}) | mask(typename TFilter::TAdded{})) | ... | mask<TF>(true));
+		}(typename TFilter::TFetches{});
+		static constexpr TComponentBits writes = []<class... TF>(TypeList<TF...>) {
+			return (TComponentBits{} | ... | mask<TF>(false));
+		}(typename TFilter::TFetches{});
+	};
+
+	template<class TEntityManager, class... TArgs>
+	class Scheduler;
+
+	// Runs systems on a thread pool, passing them 'TArgs'.
+	// Every system gets a query, whose terms determine which components it reads and writes. It must not reach the
+	// components in other ways, since the scheduler would not know about that access.
+	// Two systems conflict if one writes components the other accesses. Conflicting systems run in the order they
+	// were added, all others may run concurrently. The resulting dependency graph is laid out in stages: every system
+	// runs in the stage after the last system it depends on, and the systems of a stage run in parallel.
+	// Systems are free to use the parallel functions of their queries on the same pool.
+	template<class... TComponents, class... TArgs>
+	class Scheduler<EntityManager<TComponents...>, TArgs...> {
+		using TEntityManager = EntityManager<TComponents...>;
+		using TComponentStorage = ComponentStorage<TComponents...>;
+		using TComponentBits = typename TComponentStorage::TComponentBits;
+
+		TEntityManager& em;
+
+		struct System {
+			std::string name;
+			TComponentBits reads, writes;
+			bool exclusive;
+			std::function<void(TArgs...)> run;
+		};
+		std::vector<System> systems;
+		std::vector<std::vector<size_t>> stages; // indices of the systems of each stage
+		bool dirty = false;
+
+		static bool conflict(System const& a, System const& b) {
+			return a.exclusive || b.exclusive || a.writes.intersects(b.reads | b.writes) || b.writes.intersects(a.reads);
+		}
+
+		void buildStages() {
+			std::vector<size_t> stageOf(systems.size(), 0);
+			stages.clear();
+			for (size_t j = 0; j < systems.size(); ++j) {
+				for (size_t i = 0; i < j; ++i)
+					if (conflict(systems[i], systems[j]))
+						stageOf[j] = std::max(stageOf[j], stageOf[i] + 1);
+				if (stageOf[j] >= stages.size())
+					stages.resize(stageOf[j] + 1);
+				stages[stageOf[j]].push_back(j);
+			}
+			dirty = false;
+		}
+
+	public:
+		template<class... TTerms>
+		using Query = typename TEntityManager::template Query<TTerms...>;
+
+		explicit Scheduler(TEntityManager& em) : em{ em } {}
+
+		// Adds a system that accesses the components through a query with the terms 'TTerms', e.g.
+		// add<transform, const physics>("name", [](auto& q, float dt){ q.forEach(...); }) writes transform and reads physics.
+		template<class... TTerms>
+		void add(std::string name, std::type_identity_t<std::function<void(Query<TTerms...>&, TArgs...)>> f) {
+			using TAccess = SystemAccess<TComponentStorage, TTerms...>;
+			systems.push_back({ std::move(name), TAccess::reads, TAccess::writes, false,
+				[q = em.template query<TTerms...>(), f = std::move(f)](TArgs... args) mutable { f(q, args...); } });
+			dirty = true;
+		}
+		// Adds a system that changes the structure of the entity manager, e.g. by flushing command buffers.
+		// It runs on its own and may use the entity manager freely.
+		void addExclusive(std::string name, std::function<void(TArgs...)> f) {
+			systems.push_back({ std::move(name), {}, {}, true, std::move(f) });
+			dirty = true;
+		}
+
+		// Runs every system once and returns when all have finished.
+		void run(ThreadPool& tp, TArgs... args) {
+			if (dirty)
+				buildStages();
+			for (auto const& stage : stages)
+				tp.parallelFor(stage.size(), [this, &stage, &args...](size_t i) {
+					systems[stage[i]].run(args...);
+					});
+		}
+
+		// Returns the names of the systems of each stage, in order of execution.
+		std::vector<std::vector<std::string>> getStages() {
+			if (dirty)
+				buildStages();
+			std::vector<std::vector<std::string>> names;
+			for (auto const& stage : stages) {
+				auto& n = names.emplace_back();
+				for (size_t i : stage)
+					n.push_back(systems[i].name);
+			}
+			return names;
+		}
+	};
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+namespace ecs {
+
+	// Persistent pool of worker threads.
+	// Every worker owns a task queue. It takes work from the back of its own queue and steals from the front of
+	// the others when it runs dry. Ranges are split lazily, so thieves always take the biggest remaining piece.
+	class ThreadPool {
+		struct Job {
+			void (*run)(void* ctx, size_t i);
+			void* ctx;
+			std::atomic<size_t> remaining;
+		};
+		struct Task {
+			Job* job;
+			size_t begin, end;
+		};
+		struct Queue {
+			std::mutex m;
+			std::deque<Task> tasks;
+		};
+
+		std::vector<std::unique_ptr<Queue>> queues; // one per worker, the last one is shared by outside threads
+		std::vector<std::thread> threads;
+		std::atomic<size_t> queued{ 0 };
+		std::atomic<size_t> sleeping{ 0 };
+		std::mutex sleepMutex;
+		std::condition_variable sleepCv;
+		bool stopping = false;
+
+		static inline thread_local ThreadPool* currentPool = nullptr;
+		static inline thread_local size_t currentIndex = 0;
+
+		size_t ownQueue() const {
+			return currentPool == this ? currentIndex : threads.size();
+		}
+
+		void push(size_t q, Task const& t) {
+			{
+				std::lock_guard lk(queues[q]->m);
+				queues[q]->tasks.push_back(t);
+			}
+			queued.fetch_add(1);
+			if (sleeping.load() > 0) {
+				{ std::lock_guard lk(sleepMutex); }
+				sleepCv.notify_one();
+			}
+		}
+
+		// Takes a task from the back of queue 'q' or steals one from the front of another queue.
+		bool pop(size_t q, Task& t) {
+			for (size_t k = 0; k < queues.size(); ++k) {
+				auto& queue = *queues[(q + k) % queues.size()];
+				std::lock_guard lk(queue.m);
+				if (queue.tasks.empty())
+					continue;
+				if (k == 0) {
+					t = queue.tasks.back();
+					queue.tasks.pop_back();
+				}
+				else {
+					t = queue.tasks.front();
+					queue.tasks.pop_front();
+				}
+				queued.fetch_sub(1);
+				return true;
+			}
+			return false;
+		}
+
+		// Splits off the upper halves of the range for others to steal, then runs its first item.
+		void execute(size_t q, Task t) {
+			while (t.end - t.begin > 1) {
+				size_t mid = t.begin + (t.end - t.begin) / 2;
+				push(q, { t.job, mid, t.end });
+				t.end = mid;
+			}
+			t.job->run(t.job->ctx, t.begin);
+			t.job->remaining.fetch_sub(1, std::memory_order_release);
+		}
+
+		void work(size_t i) {
+			currentPool = this;
+			currentIndex = i;
+			Task t;
+			while (true) {
+				if (pop(i, t)) {
+					execute(i, t);
+					continue;
+				}
+				std::unique_lock lk(sleepMutex);
+				sleeping.fetch_add(1);
+				sleepCv.wait(lk, [this] { return stopping || queued.load() > 0; });
+				sleeping.fetch_sub(1);
+				if (stopping)
+					return;
+			}
+		}
+
+	public:
+		// Starts 'numThreads' workers. The thread calling 'parallelFor' takes part in the work as well.
+		explicit ThreadPool(size_t numThreads = std::max(1u, std::thread::hardware_concurrency()) - 1) {
+			for (size_t i = 0; i <= numThreads; ++i)
+				queues.push_back(std::make_unique<Queue>());
+			for (size_t i = 0; i < numThreads; ++i)
+				threads.emplace_back([this, i] { work(i); });
+		}
+		~ThreadPool() {
+			{
+				std::lock_guard lk(sleepMutex);
+				stopping = true;
+			}
+			sleepCv.notify_all();
+			for (auto& t : threads)
+				t.join();
+		}
+		ThreadPool(ThreadPool const&) = delete;
+		ThreadPool& operator=(ThreadPool const&) = delete;
+
+		// Returns the number of threads that can work at the same time, including one outside thread.
+		size_t size() const {
+			return threads.size() + 1;
+		}
+
+		// Returns the index [0,size()) of the calling thread. All threads outside the pool share the last index.
+		size_t workerIndex() const {
+			return ownQueue();
+		}
+
+		// Calls 'f' for every index in [0,n) and returns once all calls have finished.
+		// The calling thread runs tasks while waiting, so nested calls from inside the pool are fine.
+		template<class F>
+		void parallelFor(size_t n, F&& f) {
+			if (n == 0)
+				return;
+			if (threads.empty() || n == 1) {
+				for (size_t i = 0; i < n; ++i)
+					f(i);
+				return;
+			}
+			using TF = std::remove_reference_t<F>;
+			Job job{ [](void* ctx, size_t i) { (*static_cast<TF*>(ctx))(i); }, (void*)std::addressof(f), n };
+			const size_t q = ownQueue();
+			push(q, { &job, 0, n });
+			Task t;
+			while (job.remaining.load(std::memory_order_acquire) > 0) {
+				if (pop(q, t))
+					execute(q, t);
+				else
+					std::this_thread::yield();
+			}
+		}
+	};
+
+}
@@ -7,78 +7,236 @@
 #include <iostream>
 #include <chrono>
 #include <vector>
+#include <string>
+#include <string_view>
 #include <map>
-#include <numeric>
-#include <iomanip>
+#include <mutex>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <algorithm>
-//#include <omp.h>
+#include <atomic>
+#include <fstream>
 
 
 #define _FUNC_ __FUNCTION__
 
+#define TIMER_CONCAT_(a, b) a##b
+#define TIMER_CONCAT(a, b) TIMER_CONCAT_(a, b)
 
+// Times the enclosing scope. The name is interned only once per call site.
+#define AUTO_TIMER(timer, name) \
+    static const Timer::ScopeId TIMER_CONCAT(timerScope, __LINE__) = (timer).intern(name); \
+    AutoTimer TIMER_CONCAT(autoTimer, __LINE__)((timer), TIMER_CONCAT(timerScope, __LINE__))
+
+
+// Hierarchical profiler.
+// Every thread records into its own call tree without locking. The trees are merged by 'print'.
+// Optionally, the most recent individual scopes are kept for a timeline, see 'enableTracing'.
 class Timer
 {
-    std::chrono::high_resolution_clock hrc;
+public:
+    using ScopeId = std::uint32_t;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::uint32_t none = UINT32_MAX;
+
+    struct Node
+    {
+        ScopeId scope;
+        std::uint32_t parent;
+        std::uint32_t firstChild = none, nextSibling = none;
+        std::int64_t count = 0;
+        std::int64_t ns = 0;
+    };
+    // A single timed scope, for tracing.
+    struct Event
+    {
+        ScopeId scope;
+        std::int64_t startNs; // since 'epoch'
+        std::int64_t ns;
+    };
+    // Call tree and open scopes of one thread. Only touched by its thread, except when printing.
+    struct ThreadData
+    {
+        std::vector<Node> nodes; // nodes[0] is the root
+        std::uint32_t current = 0;
+        std::vector<Clock::time_point> startTimes;
+        std::vector<Event> events; // ring buffer of the last 'traceCapacity' scopes
+        std::uint64_t numEvents = 0;
+
+        ThreadData()
+        {
+            nodes.reserve(256);
+            nodes.push_back({ none, none });
+            startTimes.reserve(64);
+        }
+    };
+    // Call tree of all threads combined.
     struct Entry
     {
-        std::string name, fullName;
-        int count;
-        float time;
-        Entry* mommy = nullptr;
-        std::vector<Entry*> children;
-        std::chrono::time_point<decltype(hrc)> startTime;
+        ScopeId scope;
+        std::int64_t count = 0;
+        std::int64_t ns = 0;
+        std::vector<Entry> children;
     };
-    std::map<std::string, Entry*> entries;
-    Entry* current = nullptr;
 
-public:
-    Timer()
+    mutable std::mutex mutex; // guards 'names', 'nameIds' and 'threads'
+    std::vector<std::string> names;
+    std::map<std::string, ScopeId, std::less<>> nameIds;
+    std::vector<std::unique_ptr<ThreadData>> threads;
+    const std::uint64_t uid = nextUid();
+    const Clock::time_point epoch = Clock::now();
+    std::atomic<size_t> traceCapacity{ 0 };
+
+    static std::uint64_t nextUid()
     {
-        current = new Entry{ "" };
+        static std::atomic<std::uint64_t> counter{ 0 };
+        return ++counter;
     }
-    ~Timer()
+
+    ThreadData& local()
     {
-        std::function<void(Entry*)> cleanup = [&](Entry* e) {
-            for (auto& a : e->children) { cleanup(a); a = nullptr; }
-        };
-        cleanup(current);
-        delete current;
-        current = nullptr;
+        thread_local std::vector<std::pair<std::uint64_t, ThreadData*>> cache;
+        for (auto& [u, d] : cache)
+            if (u == uid)
+                return *d;
+        std::lock_guard lk(mutex);
+        ThreadData* d = threads.emplace_back(std::make_unique<ThreadData>()).get();
+        cache.emplace_back(uid, d);
+        return *d;
+    }
+
+    static void merge(Entry& into, ThreadData const& d, std::uint32_t node)
+    {
+        into.count += d.nodes[node].count;
+        into.ns += d.nodes[node].ns;
+        std::vector<std::uint32_t> children;
+        for (auto c = d.nodes[node].firstChild; c != none; c = d.nodes[c].nextSibling)
+            children.push_back(c);
+        for (auto it = children.rbegin(); it != children.rend(); ++it) // in order of first call
+        {
+            ScopeId s = d.nodes[*it].scope;
+            auto e = std::find_if(into.children.begin(), into.children.end(), [s](Entry const& x) { return x.scope == s; });
+            if (e == into.children.end())
+                e = into.children.insert(e, Entry{ s });
+            merge(*e, d, *it);
+        }
+    }
+
+public:
+    // Returns the id for 'name', registering it on first use.
+    ScopeId intern(std::string_view name)
+    {
+        std::lock_guard lk(mutex);
+        auto it = nameIds.find(name);
+        if (it != nameIds.end())
+            return it->second;
+        names.emplace_back(name);
+        return nameIds[names.back()] = static_cast<ScopeId>(names.size() - 1);
     }
-    void start(std::string cat)
+
+    void start(ScopeId scope)
     {
-        auto fullName = current->fullName + "/" + cat;
-        Entry* e;
-        if (!(e = entries[fullName]))
+        ThreadData& d = local();
+        std::uint32_t c = d.nodes[d.current].firstChild;
+        while (c != none && d.nodes[c].scope != scope)
+            c = d.nodes[c].nextSibling;
+        if (c == none)
         {
-            e = new Entry{ cat,fullName,0,0,current };
-            entries[fullName] = e;
-            current->children.push_back(e);
+            c = static_cast<std::uint32_t>(d.nodes.size());
+            d.nodes.push_back({ scope, d.current, none, d.nodes[d.current].firstChild });
+            d.nodes[d.current].firstChild = c;
         }
-        e->startTime = hrc.now();
-        current = e;
+        d.current = c;
+        d.startTimes.push_back(Clock::now());
+    }
+    void start(std::string_view cat)
+    {
+        start(intern(cat));
     }
     float end()
     {
-        using namespace std::chrono;
-        if (!current->mommy)
+        auto end = Clock::now();
+        ThreadData& d = local();
+        if (d.current == 0)
         {
             fmt::print(fg(fmt::color::orange), "WARNING: Timer stopped more often than started.\n");
             return -1;
         }
-        auto end = hrc.now();
-        auto passedSeconds = 1e-9f * duration_cast<nanoseconds>(end - current->startTime).count();
-        current->count++;
-        current->time += passedSeconds;
-        current = current->mommy;
-        return passedSeconds;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - d.startTimes.back()).count();
+        d.startTimes.pop_back();
+        Node& n = d.nodes[d.current];
+        n.count++;
+        n.ns += ns;
+        if (size_t cap = traceCapacity.load(std::memory_order_relaxed))
+        {
+            if (d.events.size() != cap)
+            {
+                d.events.assign(cap, {});
+                d.numEvents = 0;
+            }
+            auto startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - epoch).count() - ns;
+            d.events[d.numEvents++ % cap] = { n.scope, startNs, ns };
+        }
+        d.current = n.parent;
+        return 1e-9f * ns;
+    }
+
+    // Keeps the last 'capacity' scopes of every thread for 'writeTrace'. 0 disables tracing.
+    void enableTracing(size_t capacity)
+    {
+        traceCapacity = capacity;
     }
+
+    // Writes the traced scopes as Chrome Trace Event JSON, viewable in chrome://tracing or Perfetto.
+    // Must not run while other threads are timing.
+    bool writeTrace(std::string const& path) const
+    {
+        std::ofstream out(path);
+        if (!out)
+            return false;
+        auto escape = [](std::string const& s) {
+            std::string r;
+            for (char c : s) {
+                if (c == '"' || c == '\\')
+                    r += '\\';
+                r += c;
+            }
+            return r;
+        };
+        std::lock_guard lk(mutex);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        for (size_t tid = 0; tid < threads.size(); ++tid)
+        {
+            ThreadData const& d = *threads[tid];
+            const size_t cap = d.events.size();
+            const std::uint64_t n = std::min<std::uint64_t>(d.numEvents, cap);
+            for (std::uint64_t i = d.numEvents - n; i < d.numEvents; ++i)
+            {
+                Event const& e = d.events[i % cap];
+                out << (first ? "" : ",") << fmt::format(
+                    "\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":0,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                    escape(names[e.scope]), tid, 1e-3 * e.startNs, 1e-3 * e.ns);
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+    // Prints the merged call trees of all threads. Must not run while other threads are timing.
     void print() const
     {
         using namespace std;
+        Entry root{ none };
+        {
+            std::lock_guard lk(mutex);
+            for (auto& d : threads)
+                merge(root, *d, 0);
+        }
+
         fmt::print("\n{}\n", string(83, '='));
 
         fmt::color rowCols[] = { fmt::color::black, fmt::color::dark_slate_gray };
@@ -86,20 +244,20 @@ public:
         fmt::print(bg(fmt::color::teal),
                    "{:<46} : {:>8} | {:>10} | {:>10}", "Function", "Count", "Time [s]", "Time/Call");
         fmt::print(bg(rowCols[0]), "\n");
-        std::function<void(Entry*, int, bool)> printEntry = [&](Entry* e, int level, bool lastChild)
+        std::function<void(Entry const&, int, bool)> printEntry = [&](Entry const& e, int level, bool lastChild)
         {
-            if (!e->fullName.empty()) {
+            if (e.scope != none) {
+                float time = 1e-9f * e.ns;
                 fmt::print(bg(rowCols[(rowIdx++) % 2]), "{:<46} : {:>8} | {:>10.6f} | {:>10.6f}",
                            std::string(2 * std::max(0, level - 1), ' ') +
-                           (level ? lastChild ? "`-" : "|-" : "") + e->name,
-                           e->count, e->time, (e->time / e->count));
+                           (level ? lastChild ? "`-" : "|-" : "") + names[e.scope],
+                           e.count, time, (time / e.count));
 
                 fmt::print(bg(rowCols[0]), "\n");
             }
-            for (int i = 0;i<e->children.size();++i)
-                printEntry(e->children[i], level + 1, i == e->children.size()-1);
+            for (int i = 0;i<e.children.size();++i)
+                printEntry(e.children[i], level + 1, i == e.children.size()-1);
         };
-        Entry* root = current; while (root->mommy) { root = root->mommy; }
         printEntry(root, -1, false);
 
         fmt::print("{}\n", string(83, '='));
@@ -110,12 +268,13 @@ class AutoTimer
     Timer* timer = nullptr;
 public:
 
-    AutoTimer(Timer& t, std::string cat)
+    AutoTimer(Timer& t, Timer::ScopeId scope)
     {
-//		if (omp_in_parallel())
-//			return; // Timer is not thread safe. Avoid UB.
         timer = std::addressof(t);
-        timer->start(cat);
+        timer->start(scope);
+    }
+    AutoTimer(Timer& t, std::string_view cat) : AutoTimer(t, t.intern(cat))
+    {
     }
     ~AutoTimer()
     {
@@ -127,4 +286,3 @@ public:
 
 
 static Timer g_timer;
-